@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""Generate reproducible benchmark PDFs for 'least --bench'.
+
+Usage: genpdf.py {text,vector,image} output.pdf [pages]
+
+Every document is generated from a fixed seed, so the same command produces
+byte-identical files on any machine. Only the Python standard library is used.
+"""
+
+import random
+import sys
+import zlib
+
+PAGE_W, PAGE_H = 612, 792  # US Letter, in points
+
+WORDS = (
+    "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod "
+    "tempor incididunt ut labore et dolore magna aliqua enim ad minim veniam "
+    "quis nostrud exercitation ullamco laboris nisi aliquip ex ea commodo "
+    "consequat duis aute irure in reprehenderit voluptate velit esse cillum "
+    "fugiat nulla pariatur excepteur sint occaecat cupidatat non proident sunt "
+    "culpa qui officia deserunt mollit anim id est laborum"
+).split()
+
+
+class Writer:
+    def __init__(self):
+        self.objects = []
+
+    def add(self, body):
+        """Add an object and return its object number."""
+        self.objects.append(body)
+        return len(self.objects)
+
+    def reserve(self):
+        return self.add(b"")
+
+    def set(self, num, body):
+        self.objects[num - 1] = body
+
+    def stream(self, data, extra=b"", compress=True):
+        if compress:
+            data = zlib.compress(data, 6)
+            extra += b" /Filter /FlateDecode"
+        head = b"<< /Length %d%s >>\nstream\n" % (len(data), extra)
+        return self.add(head + data + b"\nendstream")
+
+    def write(self, path, root):
+        out = bytearray(b"%PDF-1.4\n%\xe2\xe3\xcf\xd3\n")
+        offsets = []
+        for i, body in enumerate(self.objects):
+            offsets.append(len(out))
+            out += b"%d 0 obj\n" % (i + 1) + body + b"\nendobj\n"
+        xref = len(out)
+        out += b"xref\n0 %d\n0000000000 65535 f \n" % (len(self.objects) + 1)
+        for off in offsets:
+            out += b"%010d 00000 n \n" % off
+        out += b"trailer\n<< /Size %d /Root %d 0 R >>\nstartxref\n%d\n%%%%EOF\n" % (
+            len(self.objects) + 1, root, xref)
+        with open(path, "wb") as f:
+            f.write(out)
+
+
+def text_page(rnd, pdf, resources):
+    """66 lines of 8pt running text in two fonts."""
+    ops = [b"BT", b"11 TL", b"36 %d Td" % (PAGE_H - 40)]
+    for line in range(66):
+        font = b"/F2" if line % 11 == 0 else b"/F1"
+        ops.append(font + b" 8 Tf")
+        words = []
+        length = 0
+        while length < 120:
+            word = rnd.choice(WORDS)
+            words.append(word)
+            length += len(word) + 1
+        text = " ".join(words).encode("ascii")
+        ops.append(b"(" + text + b") Tj T*")
+    ops.append(b"ET")
+    return b"\n".join(ops)
+
+
+def vector_page(rnd, pdf, resources):
+    """Thousands of stroked and filled curves, like a CAD drawing."""
+    ops = []
+    for _ in range(3000):
+        ops.append(b"%.3f %.3f %.3f RG %.2f w" % (
+            rnd.random(), rnd.random(), rnd.random(), rnd.uniform(0.1, 1.5)))
+        x, y = rnd.uniform(0, PAGE_W), rnd.uniform(0, PAGE_H)
+        ops.append(b"%.2f %.2f m" % (x, y))
+        for _ in range(rnd.randint(1, 4)):
+            pts = [rnd.uniform(-60, 60) for _ in range(6)]
+            ops.append(b"%.2f %.2f %.2f %.2f %.2f %.2f c" % (
+                x + pts[0], y + pts[1], x + pts[2], y + pts[3],
+                x + pts[4], y + pts[5]))
+        ops.append(b"S")
+    for _ in range(400):
+        ops.append(b"%.3f %.3f %.3f rg" % (
+            rnd.random(), rnd.random(), rnd.random()))
+        x, y = rnd.uniform(0, PAGE_W), rnd.uniform(0, PAGE_H)
+        ops.append(b"%.2f %.2f m" % (x, y))
+        for _ in range(rnd.randint(3, 7)):
+            ops.append(b"%.2f %.2f l" % (
+                x + rnd.uniform(-40, 40), y + rnd.uniform(-40, 40)))
+        ops.append(b"h f")
+    return b"\n".join(ops)
+
+
+def make_image(rnd, pdf, size):
+    """A noisy RGB gradient that does not compress to nothing."""
+    seed = rnd.randint(0, 255)
+    rows = []
+    for y in range(size):
+        row = bytearray()
+        for x in range(size):
+            row += bytes(((x + seed) & 255, (y * 2) & 255,
+                          (x ^ y ^ rnd.getrandbits(3)) & 255))
+        rows.append(bytes(row))
+    return pdf.stream(b"".join(rows),
+        b" /Type /XObject /Subtype /Image /Width %d /Height %d"
+        b" /ColorSpace /DeviceRGB /BitsPerComponent 8" % (size, size))
+
+
+def image_page(rnd, pdf, resources):
+    """Four large scanned-looking images per page."""
+    ops = []
+    names = []
+    for i in range(4):
+        num = make_image(rnd, pdf, 320)
+        name = b"Im%d" % i
+        names.append(b"/%s %d 0 R" % (name, num))
+        x = 36 + (i % 2) * 280
+        y = 60 + (i // 2) * 360
+        ops.append(b"q 260 0 0 340 %d %d cm /%s Do Q" % (x, y, name))
+    resources[b"XObject"] = b"<< " + b" ".join(names) + b" >>"
+    return b"\n".join(ops)
+
+
+KINDS = {
+    "text": (text_page, 50),
+    "vector": (vector_page, 20),
+    "image": (image_page, 20),
+}
+
+
+def main(argv):
+    if len(argv) < 3 or argv[1] not in KINDS:
+        sys.stderr.write(__doc__)
+        return 1
+
+    make_page, pagec = KINDS[argv[1]]
+    if len(argv) > 3:
+        pagec = int(argv[3])
+
+    rnd = random.Random("least-%s" % argv[1])
+    pdf = Writer()
+
+    catalog = pdf.reserve()
+    tree = pdf.reserve()
+    f1 = pdf.add(b"<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica >>")
+    f2 = pdf.add(b"<< /Type /Font /Subtype /Type1 /BaseFont /Times-Bold >>")
+
+    kids = []
+    for _ in range(pagec):
+        resources = {b"Font": b"<< /F1 %d 0 R /F2 %d 0 R >>" % (f1, f2)}
+        content = pdf.stream(make_page(rnd, pdf, resources))
+        res = b"<< " + b" ".join(
+            b"/%s %s" % (k, v) for k, v in sorted(resources.items())) + b" >>"
+        kids.append(pdf.add(
+            b"<< /Type /Page /Parent %d 0 R /MediaBox [0 0 %d %d]"
+            b" /Resources %s /Contents %d 0 R >>"
+            % (tree, PAGE_W, PAGE_H, res, content)))
+
+    pdf.set(tree, b"<< /Type /Pages /Count %d /Kids [%s] >>" % (
+        pagec, b" ".join(b"%d 0 R" % k for k in kids)))
+    pdf.set(catalog, b"<< /Type /Catalog /Pages %d 0 R >>" % tree)
+    pdf.write(argv[2], catalog)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
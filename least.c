@@ -8,8 +8,20 @@
 #include <mupdf/pdf.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
 #include <math.h>
+#include <time.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <ctype.h>
+#include <wctype.h>
+#include <locale.h>
 
 static float
     w, h,           /* Window dimensions globals */
@@ -18,23 +30,33 @@ static float
 
 static SDL_Surface *surface;
 
-static float imw, imh, ims;
-
 /* PDF rendering */
 static int pixmap_to_texture(void *pixmap, int width, int height, int format, int type);
-static int page_to_texture(fz_context *ctx, fz_document *doc, int pagenum);
+static int pixmap_format(fz_context *context, fz_pixmap *pixmap);
+static void page_texture_set(int pagenum, GLuint texture, int width,
+        int height, int format);
+static float render_width(void);
 static void draw_screen(void);
 
 static void toggle_fullscreen(void);
 
-struct least_thread;
-static void finish_page_render(struct least_thread *render);
+struct least_job;
+struct least_band_set;
+static void trace_lock_wait(double start, int lock);
+static double trace_begin(void);
+struct least_page_text;
+struct least_page_links;
+static void finish_page_render(struct least_job *job);
 
 /* Scrolling */
 static float scroll = 0.0f;
 static int autoscroll = 0;
 static int autoscroll_var = 1;
 
+/* Zoom, see view_scale */
+static float zoom = 1.0f;   /* Page width / window width */
+static float pan = 0.0f;    /* Horizontal offset of the pages, in pixels */
+
 /* Window settings */
 static int redraw = 1; /* Window dirty? */
 
@@ -54,70 +76,388 @@ static int power_of_two = 0;
 /* Set to 1 to force use of POT mechanism */
 static const int force_power_of_two = 0;
 
-/* Set to non-zero value to force render threads to specific number */
-static const int force_thread_count = 1;
+/* Set to 1 if page textures have mipmaps, see detect_mipmap (--no-mipmap) */
+static int use_mipmap = 1;
+
+/* Set to 0 to render every page in colour (--no-gray), see list_is_color */
+static int detect_gray = 1;
+
+/* Set to non-zero value to force render threads to specific number
+ * (overridden by --threads)
+ */
+static int force_thread_count = 1;
 static int thread_count = 0;
 
-/* Global PDF document */
-static fz_document *doc;
+/* Messages above this level are not logged (--log-level), see least_log */
+static int log_level = 2;   /* LEAST_LOG_INFO */
 
 struct least_page_info {
-    int w, h, sw, sh;
-    int rendering; /* Set to 1 if a thread is processing this page */
+    float aspect;   /* Height / width, see page_tops */
+    int bounded;    /* Set once 'aspect' comes from the prepass */
+    int rendering;  /* Set to 1 if a thread is processing this page */
+    int previewing; /* Same, for the low resolution preview */
+    int preview;    /* Set to 1 if 'texture' is only a preview */
+    int thumbing;   /* Same, for the overview thumbnail */
+    int thumb;      /* Thumbnail slot + 1, 0 if there is none */
     GLuint texture;
+    int tw, th;     /* Size of the pixmap in 'texture' */
+    int format;     /* GL format of 'texture' */
+    unsigned int used; /* page_clock when last shown */
+    unsigned int generation; /* render_generation of 'texture' */
+    int indexing;   /* Set to 1 while its text is being extracted */
+    int failed;     /* Set to 1 if it could not be rendered, see render_job */
+    struct least_page_text *text; /* Text index, NULL until extracted */
+    struct least_page_links *links; /* Link index, NULL until loaded */
 };
 
 /* PDF page info */
 static unsigned int pagec;
 static struct least_page_info *pages;
 
-/* Cache settings */
-static const int pages_to_cache = 5;
+/* Pages are first rendered at this fraction of the full width and shown
+ * until the full resolution render arrives. 0 disables previews (--preview).
+ */
+static float preview_scale = 0.25f;
+
+/* Cache settings
+ *
+ * Pages in the prefetch window around the focus page are rendered ahead.
+ * Rendered pages stay cached until page textures take up more than
+ * texture_budget bytes, then the least recently shown pages outside the
+ * window are evicted first. Small pages thus stay cached in large numbers.
+ * The window shrinks if its pages alone would not fit in the budget.
+ */
+static const int prefetch_pages = 5;
+static size_t texture_budget = 256 << 20; /* --cache-mb */
+static size_t texture_bytes;    /* Held by page textures */
+static size_t texture_bytes_peak;
+static int texture_pages;       /* Pages holding a texture */
+static unsigned int page_clock; /* LRU stamps, see least_page_info.used */
 static int page_focus = 0;
 
 /* Cache busy texture */
 static GLuint busy_texture;
 
+/* Overview mode
+ *
+ * Shows a grid of page thumbnails. Thumbnails are rendered by the render
+ * threads like pages are, but packed into a fixed number of large atlas
+ * textures instead of getting a texture each. This keeps GPU memory bounded
+ * for any number of pages and draws the grid with one batch per atlas.
+ */
+#define THUMB_W 128   /* Thumbnail cell size, in atlas and screen pixels */
+#define THUMB_H 176
+#define THUMB_GAP 16  /* Space between cells on screen */
+#define ATLAS_COUNT 4
+
+struct least_thumb_slot {
+    int pagenum;        /* -1 if unused */
+    int w, h;           /* Size of the thumbnail within its cell */
+    unsigned int used;  /* LRU stamp, updated whenever it is drawn */
+};
+
+static int overview = 0;    /* Set to 1 while the overview is shown */
+static float page_scroll;   /* Page view scroll to return to */
+
+static GLuint atlas_textures[ATLAS_COUNT];
+static int atlas_size;      /* Width and height of every atlas */
+static int atlas_columns;   /* Cells per atlas row */
+static int atlas_cells;     /* Cells per atlas */
+static int thumb_slots;     /* Cells in all atlases */
+static struct least_thumb_slot *thumbs;
+static unsigned int thumb_clock;
+
 /* Least page render complete event */
 #define LEAST_PAGE_COMPLETE (SDL_USEREVENT + 1)
 
-/* 'base_context' lock, see explanation in least_thread structure */
-static SDL_mutex *big_fitz_lock = NULL;
+/* More pages were bounded by the geometry prepass */
+#define LEAST_GEOMETRY_UPDATE (SDL_USEREVENT + 2)
+
+/* Zoom and window size have settled, see rescale_request */
+#define LEAST_RESCALE (SDL_USEREVENT + 3)
+
+/* Time to refresh the statistics overlay, see stats_timer_fired */
+#define LEAST_STATS_TICK (SDL_USEREVENT + 4)
+
+/* SIGUSR1 arrived, see stats_signal_thread */
+#define LEAST_STATS_DUMP (SDL_USEREVENT + 5)
+
+/* Per-stage render timings, in seconds */
+struct least_render_times {
+    double wait;    /* Queued until a render thread took the job */
+    double load;    /* fz_load_page + fz_bound_page */
+    double list;    /* Display list build (fz_run_page) */
+    double raster;  /* fz_run_display_list */
+    double upload;  /* Texture upload, only if a GL context exists */
+};
+
+/* Growable sample set used for percentile reports */
+struct least_samples {
+    double *v;
+    int count, size;
+};
+
+/* Name of the open document, render threads open their own handle */
+static char *doc_filename;
 
 /* Every thread is tracked by this structure */
 struct least_thread {
-    /* Communication synchronisation */
-    SDL_cond *cond;
-    SDL_mutex *mutex;
-
     /* Thread ID */
     SDL_Thread *handle;
     Uint32 tid;
     int id;
 
     /* Fitz base_context and context.
-     * 'context' is cloned from 'base_context' upon thread entry
-     * 'base_context' is used for all non-parallel Fitz operation.
+     * 'context' is cloned from 'base_context' upon thread entry.
+     *
+     * Every thread opens its own handle 'doc' on the document using
+     * 'context', so loading and interpreting pages needs no locking beyond
+     * what Fitz does internally through least_context_locks.
      */
     fz_context
         *base_context,
         *context;
+    fz_document *doc;
 
-    /* Pre-refresh flag */
-    int pre_refresh;
-
-    /* Action specification */
     volatile int keep_running;
-    volatile int pagenum;
-    volatile float scale;
 
-    /* Action results */
-    volatile fz_pixmap *pixmap;
+    /* Job being rendered, NULL if idle. Protected by queue.lock */
+    struct least_job *job;
+
+    /* Render to write to the disk cache once its job has been handed on,
+     * NULL if none. Holds a reference of its own, see disk_cache_store.
+     */
+    fz_pixmap *store;
+    int store_page;
+    float store_width, store_height;
 };
 
 static struct least_thread *threads;
-static struct least_thread **idle_threads;
-static int idle_thread_count;
+static int idle_thread_count; /* Protected by queue.lock */
+
+/* A pixel buffer object of the upload ring, see init_pbos.
+ *
+ * Buffers stay mapped while they are idle, so a render thread can rasterize
+ * a page straight into 'data'. Only the main thread touches the GL side.
+ */
+struct least_pbo {
+    GLuint name;
+    void *data;     /* Mapped storage, NULL if not mapped */
+    size_t size;    /* Bytes of mapped storage */
+    int in_use;     /* Set to 1 while attached to a job or uploading */
+};
+
+/* A render job
+ *
+ * Jobs carry everything a render thread needs, so threads never read the
+ * main thread's view state. A job belongs to the queue until a render thread
+ * takes it, and to the main thread again once the result is delivered.
+ */
+struct least_job {
+    int pagenum;
+    unsigned int generation; /* render_generation when scheduled */
+    float width;             /* Render width when scheduled */
+    float height;            /* Maximum render height, 0 for none */
+    int kind;                /* One of LEAST_JOB_* */
+    int priority;            /* Lower is more urgent, see page_priority */
+    double queued;           /* When it was scheduled */
+    double deadline;         /* See page_deadline, 0 for none */
+
+    /* Set cookie.abort to cancel the job while it is being rendered */
+    fz_cookie cookie;
+
+    /* Non-NULL for band tickets, see rasterize_bands */
+    struct least_band_set *bands;
+
+    /* Mapped buffer to rasterize into, may be NULL. Set by the main thread
+     * while the job is queued.
+     */
+    struct least_pbo *pbo;
+
+    /* Results, 'pixmap' is NULL if the job was cancelled or failed */
+    struct least_thread *thread;
+    fz_pixmap *pixmap;
+    int failed;               /* Set if MuPDF threw, the page is damaged */
+    struct least_page_text *text; /* Same, for LEAST_JOB_TEXT */
+    struct least_page_links *links; /* Loaded with the page, may be NULL */
+    int want_links;           /* The page had no link index when scheduled */
+    unsigned int page_count;  /* LEAST_JOB_OPEN, 0 if opening failed */
+    float aspect;             /* Same, of the first page */
+    int disk_cache;           /* Same, 0 if the disk cache cannot be used */
+    struct least_render_times times;
+
+    /* Disk cache file 'pixmap' is mapped from, if any, see disk_cache_load */
+    void *map;
+    size_t map_size;
+};
+
+/* Kinds of render jobs */
+#define LEAST_JOB_PAGE 0     /* Full resolution page */
+#define LEAST_JOB_PREVIEW 1  /* Low resolution preview, see preview_scale */
+#define LEAST_JOB_THUMB 2    /* Overview thumbnail */
+#define LEAST_JOB_TEXT 3     /* Text extraction, see page_to_text */
+#define LEAST_JOB_OPEN 4     /* Opens the document, see open_pdf */
+
+/* Render job queue
+ *
+ * A binary min-heap on job priority shared by all render threads. The main
+ * thread reprioritises it whenever the view changes, so an idle thread always
+ * takes the most urgent page next.
+ */
+struct least_job_queue {
+    SDL_mutex *lock;
+    SDL_cond *cond; /* Signalled when jobs are added or threads must stop */
+
+    struct least_job **heap;
+    int count, size;
+};
+
+static struct least_job_queue queue;
+
+/* Signalled on queue.lock whenever a band is rasterized */
+static SDL_cond *band_cond;
+
+/* Rasterize visible pages in this many bands (--bands) */
+static int band_count = 1;
+
+/* Bumped whenever the render settings change, see rescale. Completed jobs of
+ * an older generation are discarded.
+ */
+static unsigned int render_generation;
+
+/* Render statistics, only touched by the main thread */
+static int renders_scheduled[4]; /* By job kind */
+static int renders_completed; /* Turned into a texture */
+static int renders_cancelled; /* Aborted through their cookie */
+static int renders_failed;    /* MuPDF could not render the page */
+static int renders_discarded; /* Completed, but stale by then */
+
+/* Frame scheduling
+ *
+ * Frames are drawn at most once per display refresh, and only if something
+ * on screen changed (redraw). With swap control SDL_GL_SwapBuffers waits for
+ * the refresh, otherwise the main loop sleeps until the next one is due.
+ * Events arriving in the meantime, input and completed renders alike, are
+ * all handled before the frame is drawn, so a burst of them costs one frame.
+ */
+#define FRAME_MARGIN 0.004      /* Be ready this long before a vsync swap */
+
+static double frame_interval = 1 / 60.; /* --fps */
+static int vsync;               /* Set if swap control is in effect */
+static double frame_last;       /* When the last frame was presented */
+static double frame_work;       /* Event handling time of the next frame */
+static int frame_animated;      /* The last frame was drawn animating */
+static double animate_time;     /* Time autoscroll was last advanced to */
+
+/* Main thread timings, reported on exit */
+static struct least_samples frame_times;  /* Frame work, without waiting */
+static struct least_samples upload_times; /* Texture upload of a page */
+static struct least_samples frame_intervals; /* Between animated frames */
+static int frames_dropped;      /* Refreshes missed while animating */
+static double frame_start;
+
+/* Frees a job that is done with, returning its buffer to the ring.
+ * Its pixmap must have been dropped.
+ */
+static void job_free(struct least_job *job)
+{
+    if (job->pbo)
+        job->pbo->in_use = 0;
+
+    if (job->map)
+        munmap(job->map, job->map_size);
+
+    free(job);
+}
+
+/* Job queue heap operations, all must be called with queue.lock held */
+static void queue_swap(int a, int b)
+{
+    struct least_job *t = queue.heap[a];
+
+    queue.heap[a] = queue.heap[b];
+    queue.heap[b] = t;
+}
+
+static void queue_sift_down(int i)
+{
+    int c;
+
+    while ((c = i * 2 + 1) < queue.count) {
+        if (c + 1 < queue.count &&
+                queue.heap[c + 1]->priority < queue.heap[c]->priority)
+            c++;
+
+        if (queue.heap[i]->priority <= queue.heap[c]->priority)
+            break;
+
+        queue_swap(i, c);
+        i = c;
+    }
+}
+
+static void queue_push(struct least_job *job)
+{
+    int i, p;
+
+    if (queue.count == queue.size) {
+        queue.size *= 2;
+        queue.heap = realloc(queue.heap,
+            sizeof(struct least_job*) * queue.size);
+        if (!queue.heap) {
+            fprintf(stderr, "Out of memory while queueing jobs\n");
+            abort();
+        }
+    }
+
+    i = queue.count++;
+    queue.heap[i] = job;
+
+    while (i && queue.heap[p = (i - 1) / 2]->priority > job->priority) {
+        queue_swap(i, p);
+        i = p;
+    }
+}
+
+static struct least_job *queue_pop(void)
+{
+    struct least_job *job = queue.heap[0];
+
+    queue.heap[0] = queue.heap[--queue.count];
+    queue_sift_down(0);
+
+    return job;
+}
+
+/* Restores heap order after priorities were changed in place */
+static void queue_heapify(void)
+{
+    int i;
+
+    for (i = queue.count / 2 - 1; i >= 0; i--)
+        queue_sift_down(i);
+}
+
+/* Drops all queued jobs and cancels all jobs being rendered, except for
+ * text extraction, which does not depend on the render settings
+ */
+static void queue_clear(void)
+{
+    int i, count = 0;
+
+    for (i = 0; i < queue.count; i++)
+        if (queue.heap[i]->kind == LEAST_JOB_TEXT)
+            queue.heap[count++] = queue.heap[i];
+        else
+            job_free(queue.heap[i]);
+
+    queue.count = count;
+    queue_heapify();
+
+    for (i = 0; i < thread_count; i++)
+        if (threads[i].job && threads[i].job->kind != LEAST_JOB_TEXT)
+            threads[i].job->cookie.abort = 1;
+}
 
 /* Fitz lock support */
 static SDL_mutex *least_lock_list[FZ_LOCK_MAX];
@@ -125,7 +465,9 @@ static SDL_mutex *least_lock_list[FZ_LOCK_MAX];
 static void least_lock(void *user, int lock) {
     int err;
     SDL_mutex **m = user;
+    double t = trace_begin();
     err = SDL_mutexP(m[lock]);
+    trace_lock_wait(t, lock);
     if (err) {
         fprintf(stderr, "During fitz lock %d, SDL error occurred: %s\n", lock,
             SDL_GetError());
@@ -148,322 +490,3984 @@ static struct fz_locks_context_s least_context_locks = {
     least_unlock
 };
 
+/* Benchmark mode (--bench) */
+static int bench = 0;
+static int bench_gl = 0;      /* Also upload textures (needs a window) */
+static int bench_passes = 1;  /* Render every page this many times */
+static int bench_width = 0;   /* Render width, 0 means window/1024 */
+static int bench_quads = 0;   /* Quads to draw per frame, 0 for none */
 
-/* Page visibility */
-int inrange(float s, float e, float p) {
-    float ss, ee;
-    /* I know, right */
-    if (s > e) {
-        ss = e;
-        ee = s;
-    } else {
-        ss = s;
-        ee = e;
-    }
-
-    return p > ss && p < ee;
-}
-
-int visible_pages(int * pageinfo) {
-    unsigned int i, a;
-    float f, pf, s, e, scale;
-    f = pf = 0;
-    s = e = 0;
-    pageinfo = NULL;
-    a = 0;
-
-    for(i = 0; i < pagec; i++) {
-        scale = (((float)pages[i].sw / pages[i].w) * pages[i].w) / w;
+/* In benchmark mode completed jobs are handed to the main thread through
+ * this stack instead of the SDL event queue, since there is no video
+ * subsystem to carry events. Protected by queue.lock.
+ */
+static SDL_cond *bench_cond;
+static struct least_job **bench_done;
+static int bench_done_count;
 
-        pf = f;
-        f -= pages[i].sh;
 
-        s = scroll;
-        e = scroll - h * scale;
+/* Monotonic time in seconds */
+static double least_time(void)
+{
+    struct timespec ts;
 
-        if (
-            inrange(s, e, pf) ||
-            inrange(s, e, f)  ||
-            inrange(pf, f, s) ||
-            inrange(pf, f, e)
-        ) {
-            pageinfo = realloc(pageinfo, sizeof(int) * ++a);
-            pageinfo[a - 1] = i;
-        }
-    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    return a;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-int open_pdf(fz_context *context, char *filename) {
-    fz_stream *file;
-    int faulty;
-    unsigned int i;
-    /* char * s; */
+/* Logging
+ *
+ * Render threads used to printf several lines per page and serialised on
+ * the stdio lock, which is slow when stdout is a terminal. Now every thread
+ * formats its messages into a ring of its own, and a writer thread prints
+ * them every LOG_INTERVAL ms. A thread never waits for the writer: when its
+ * ring is full the message is dropped and counted.
+ *
+ * Each ring has a single producer, its thread, and a single consumer, the
+ * writer, so head and tail only need memory barriers, no lock.
+ *
+ * least_debug compiles to nothing in release builds (-DNDEBUG), so per-page
+ * messages cost nothing there.
+ */
+#define LEAST_LOG_ERROR 0
+#define LEAST_LOG_WARN 1
+#define LEAST_LOG_INFO 2
+#define LEAST_LOG_DEBUG 3
+
+#define LOG_THREADS 64
+#define LOG_RING 256        /* Messages, a power of 2 */
+#define LOG_LINE 256        /* Longer messages are cut short */
+#define LOG_INTERVAL 20     /* ms */
+
+struct least_log_record {
+    int level;
+    char text[LOG_LINE];
+};
 
-    faulty = 0;
+struct least_log_ring {
+    Uint32 tid;
+    volatile unsigned int head;     /* Written by the owning thread */
+    volatile unsigned int tail;     /* Written by the writer thread */
+    volatile unsigned int dropped;
+    struct least_log_record records[LOG_RING];
+};
 
-    /* Resolution */
+static struct least_log_ring *log_rings[LOG_THREADS];
+static volatile int log_ring_count;
+static SDL_mutex *log_lock;         /* Protects adding rings */
+static SDL_Thread *log_thread;
+static volatile int log_running;
+static unsigned int log_dropped;    /* Reported so far, writer only */
 
-    printf("Opening: %s\n", filename);
+static const char *log_level_names[] = { "error", "warn", "info", "debug" };
 
-    fz_try(context) {
-        file = fz_open_file(context, filename);
+/* Ring of the calling thread, one is made on its first message. NULL if
+ * there are too many threads.
+ */
+static struct least_log_ring *log_ring(void)
+{
+    struct least_log_ring *r = NULL;
+    Uint32 tid = SDL_ThreadID();
+    int i;
 
-        doc = (fz_document *) pdf_open_document_with_stream(context, file);
+    for (i = 0; i < log_ring_count; i++)
+        if (log_rings[i]->tid == tid)
+            return log_rings[i];
 
-        /* TODO Password */
+    SDL_mutexP(log_lock);
+    if (log_ring_count < LOG_THREADS) {
+        r = calloc(1, sizeof(struct least_log_ring));
+        if (!r) {
+            fprintf(stderr, "Cannot allocate log ring\n");
+            abort();
+        }
+        r->tid = tid;
 
-        fz_drop_stream(context, file);
-    } fz_catch (context) {
-        fprintf(stderr, "Cannot open: %s\n", filename);
-        faulty = 1;
+        log_rings[log_ring_count] = r;
+        __sync_synchronize();
+        log_ring_count++;
     }
+    SDL_mutexV(log_lock);
 
-    if (faulty)
-        return faulty;
+    return r;
+}
 
-    /* XXX need error handling */
-    pagec = fz_count_pages(context, doc);
-    pages = malloc(sizeof(struct least_page_info) * pagec);
+static void log_print(int level, const char *text)
+{
+    fputs(text, level <= LEAST_LOG_WARN ? stderr : stdout);
+}
 
-    #if 0
-    return 0;
-    #endif
+/* Prints what all rings hold. Only one thread may drain at a time. */
+static void log_drain(void)
+{
+    struct least_log_ring *r;
+    unsigned int head, tail, dropped = 0;
+    int i, count = log_ring_count;
+
+    for (i = 0; i < count; i++) {
+        r = log_rings[i];
+        head = r->head;
+        __sync_synchronize();
+
+        for (tail = r->tail; tail != head; tail++)
+            log_print(r->records[tail % LOG_RING].level,
+                r->records[tail % LOG_RING].text);
+
+        __sync_synchronize();
+        r->tail = tail;
+        dropped += r->dropped;
+    }
 
-    for(i = 0; i < pagec; i++) {
-        pages[i].rendering = 0;
-        pages[i].texture = 0;
-        /* page_to_texture(context, doc, i); */
+    if (dropped != log_dropped) {
+        fprintf(stderr, "%u log messages dropped\n", dropped - log_dropped);
+        log_dropped = dropped;
     }
-    page_to_texture(context, doc, 0);
 
-    printf("Done opening\n");
-    return 0;
+    fflush(stdout);
 }
 
-/* This function renders the given PDF page and returns it as a pixmap
- *
- * This code is reentrant given 'thread_context' is not currently in use
- * in any other thread. If used in a non-multithreaded way, set 'thread_context'
- * to the same value as 'context'.
- */
-static fz_pixmap *page_to_pixmap(fz_context *context,
-        fz_context *thread_context, fz_document *doc, int pagenum) {
-    fz_page *page;
-    fz_display_list *list;
-    fz_pixmap *image;
-    fz_device *dev;
-    fz_rect bounds;
-    fz_irect bbox;
-    fz_matrix ctm;
-    fz_colorspace *cspace;
-    float scale;
-
-    printf("Rendering page %d\n", pagenum);
+static int log_writer(void *data)
+{
+    (void)data;
 
-    /* Now follows a bit of non-reentrant code
-     * protected by the Big Fitz Lock
-     *
-     * XXX: Introduce mutex error checking?
-     */
-    SDL_mutexP(big_fitz_lock);
-    {
-        page = fz_load_page(context, doc, pagenum);
+    while (log_running) {
+        SDL_Delay(LOG_INTERVAL);
+        log_drain();
+    }
 
-        fz_bound_page(context, page, &bounds);
+    return 0;
+}
 
-        /* XXX: There is a small risk of lw/lh being incorrect
-         * due to a race condition during a refresh.
-         * This shouldn't affect any visible pages though, as it causes renders
-         * that will be discarded by finish_page_render to be faulty.
-         */
-        ims = scale = lw / bounds.x1;
-        printf("W, H: (%f, %f)\n", lw, lh);
-        printf("Scale: %f\n", scale);
+static void init_log(void)
+{
+    log_lock = SDL_CreateMutex();
+    if (!log_lock) {
+        fprintf(stderr, "Mutex initialisation failed: %s\n",
+            SDL_GetError());
+        abort();
+    }
 
-        fz_scale(&ctm, scale, scale);
+    log_running = 1;
+    log_thread = SDL_CreateThread(log_writer, NULL);
+    if (!log_thread) {
+        fprintf(stderr, "Cannot start log thread: %s\n", SDL_GetError());
+        abort();
+    }
+}
 
-        pages[pagenum].w = bounds.x1;
-        pages[pagenum].h = bounds.y1;
+/* Stops the writer and prints what is left, called before exiting */
+static void log_stop(void)
+{
+    if (!log_thread)
+        return;
 
-        bounds.x1 *= scale;
-        bounds.y1 *= scale;
+    log_running = 0;
+    SDL_WaitThread(log_thread, NULL);
+    log_thread = NULL;
 
-        pages[pagenum].sw = bounds.x1;
-        pages[pagenum].sh = bounds.y1;
+    log_drain();
+}
 
-        fz_round_rect(&bbox, &bounds);
-        printf("Size: (%d, %d)\n", bbox.x1, bbox.y1);
+static void log_vput(int level, const char *fmt, va_list ap)
+{
+    struct least_log_ring *r;
+    struct least_log_record *rec;
 
+    if (level > log_level)
+        return;
 
-        list = fz_new_display_list(context, &bounds);
-        cspace = fz_device_rgb(context);
-        image = fz_new_pixmap_with_bbox(context, cspace, &bbox, 1);
-        dev = fz_new_list_device(context, list);
-        /* fz_run_page(doc, page, dev, ctm, NULL); */
-        fz_run_page(context, page, dev, &fz_identity, NULL);
-        fz_drop_device(context, dev);
+    r = log_thread ? log_ring() : NULL;
+    if (!r) {
+        /* No writer yet or no ring left, print it right away */
+        vfprintf(level <= LEAST_LOG_WARN ? stderr : stdout, fmt, ap);
+        return;
     }
-    SDL_mutexV(big_fitz_lock);
 
-    /* Perform actual drawing in parallel */
-    dev = fz_new_draw_device(thread_context, &fz_identity, image);
-    fz_clear_pixmap_with_value(thread_context, image, 255);
+    if (r->head - r->tail == LOG_RING) {
+        r->dropped++;
+        return;
+    }
 
-    /* XXX: Before mupdf >=1.2 it was:
-     * fz_run_display_list(list, dev, &ctm, &bbox, NULL);*/
-    fz_run_display_list(thread_context, list, dev, &ctm, &bounds, NULL);
+    rec = r->records + r->head % LOG_RING;
+    rec->level = level;
+    vsnprintf(rec->text, LOG_LINE, fmt, ap);
 
-    fz_drop_device(thread_context, dev);
+    __sync_synchronize();
+    r->head++;
+}
 
-    /* Since some allocating was done using the main context
-     * we should also deallocate using the main context.
-     * At least this seems to be the case looking at
-     * MuPDFs multithreading example.
-     */
-    SDL_mutexP(big_fitz_lock);
-    {
-        fz_drop_display_list(context, list);
-        fz_drop_page(context, page);
-    }
-    SDL_mutexV(big_fitz_lock);
+/* Logs a message if 'level' is at most log_level */
+static void least_log(int level, const char *fmt, ...)
+{
+    va_list ap;
 
-    return image;
+    va_start(ap, fmt);
+    log_vput(level, fmt, ap);
+    va_end(ap);
 }
 
-static int page_to_texture(fz_context *context, fz_document *doc, int pagenum) {
-    fz_pixmap *image;
+/* Problems worth knowing about that least can carry on after */
+static void least_warn(const char *fmt, ...)
+{
+    va_list ap;
 
-    /* Since this function is only called initially, this is an excellent place
-     * to lock the window height/width.
-     * Afterwards this can be changed using the 'F5' key.
-     */
-    lw = w;
-    lh = h;
+    va_start(ap, fmt);
+    log_vput(LEAST_LOG_WARN, fmt, ap);
+    va_end(ap);
+}
 
-    /* Convert page to pixmap */
-    image = page_to_pixmap(context, context, doc, pagenum);
+static void least_info(const char *fmt, ...)
+{
+    va_list ap;
 
-    /* Convert to texture here */
-    pages[pagenum].texture = pixmap_to_texture((void*)fz_pixmap_samples(context, image),
-            fz_pixmap_width(context, image),
-            fz_pixmap_height(context, image), 0, 0);
+    va_start(ap, fmt);
+    log_vput(LEAST_LOG_INFO, fmt, ap);
+    va_end(ap);
+}
 
-    fz_drop_pixmap(context, image);
+/* Per-page diagnostics. Use least_debug, the arguments of which are not
+ * even evaluated in release builds.
+ */
+static void least_log_debug(const char *fmt, ...)
+{
+    va_list ap;
 
-    return pages[pagenum].texture;
+    va_start(ap, fmt);
+    log_vput(LEAST_LOG_DEBUG, fmt, ap);
+    va_end(ap);
 }
 
-
-#if 0
-#define DEBUG_GL(STR) \
-    printf("OpenGL error " #STR ": %s\n", gluErrorString(glGetError()))
+#ifdef NDEBUG
+#define least_debug 1 ? (void)0 : least_log_debug
 #else
-#define DEBUG_GL(STR)
+#define least_debug least_log_debug
 #endif
 
-/* Get next power of 2 */
-#define NPOW2(D, S) \
-    { \
-        D = S; \
-        D |= D >> 1; \
-        D |= D >> 2; \
-        D |= D >> 4; \
-        D |= D >> 8; \
-        D |= D >> 16; \
-        D++; \
-    }
-
-/* Round up to power of 2 */
-#define RPOW2(D, S) \
-    { \
-        NPOW2(D, S); \
-        D = D == S << 1 ? S : D; \
-    }
-
-static int pixmap_to_texture(void *pixmap, int width, int height, int format, int type)
+/* Parses a --log-level argument, a level name or number. Returns -1 if it
+ * is neither.
+ */
+static int parse_log_level(const char *arg)
 {
-    unsigned int texname;
-    /* int max_texsize; */
+    int i;
 
-    (void)format;
-    (void)type;
+    for (i = LEAST_LOG_ERROR; i <= LEAST_LOG_DEBUG; i++)
+        if (!strcmp(arg, log_level_names[i]))
+            return i;
 
-    int pow2_width, pow2_height;
+    if (arg[0] >= '0' && arg[0] <= '3' && !arg[1])
+        return arg[0] - '0';
 
-    /* Compute POT texture dimensions */
-    RPOW2(pow2_width, width);
-    RPOW2(pow2_height, height);
+    return -1;
+}
 
-    format = 42;
-    type = 31337;
+/* Tracing (--trace)
+ *
+ * Every thread records timestamped spans of its work into a buffer of its
+ * own. On exit all of them are written as Chrome trace-event JSON, which
+ * chrome://tracing or Perfetto show as one timeline per thread. Gaps in a
+ * render thread are idle time, "lock wait" spans are contended Fitz locks.
+ *
+ * With tracing off every call returns right away, trace_begin does not even
+ * read the clock.
+ */
+#define TRACE_THREADS 64
+#define TRACE_EVENTS_MAX (1 << 20)  /* Per thread, later events are dropped */
+#define TRACE_LOCK_MIN 10e-6        /* Shorter lock waits are not recorded */
+
+struct least_trace_event {
+    const char *name;   /* A string constant */
+    double start, end;
+    int arg;            /* Page or lock number, -1 for none */
+};
 
-    glGenTextures(1, &texname);
-    printf("Generated texture: %d\n", texname);
-    DEBUG_GL(glGenTextures);
+struct least_trace_buffer {
+    Uint32 tid;
+    char name[32];
+    SDL_mutex *lock;    /* Taken by the owner to append, and to write out */
+    struct least_trace_event *events;
+    int count, size, dropped;
+};
 
-    /* Bind the texture object */
-    glBindTexture(GL_TEXTURE_2D, texname);
-    DEBUG_GL(glBindTexture);
+static char *trace_file;    /* --trace, NULL if tracing is off */
+static double trace_start;
+static SDL_mutex *trace_lock; /* Protects registering buffers */
+static struct least_trace_buffer *trace_buffers[TRACE_THREADS];
+static volatile int trace_buffer_count;
 
-    /* Set the texture's stretching properties */
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-            GL_LINEAR);
-    DEBUG_GL(glTexParameteri);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
-            GL_LINEAR);
-    DEBUG_GL(glTexParameteri);
+static void init_trace(void)
+{
+    if (!trace_file)
+        return;
 
-    /* Edit the texture object's image data using the information SDL_Surface gives us */
-    /*
-    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texsize);
-    printf("Max tex dimensions: %dx%d\n", max_texsize, max_texsize);
-    printf("width: %d, heigth %d\n", width, height);
-    */
+    trace_lock = SDL_CreateMutex();
+    if (!trace_lock) {
+        fprintf(stderr, "Mutex initialisation failed: %s\n",
+            SDL_GetError());
+        abort();
+    }
 
-    /* Special treatment is only needed if the GPU does not support NPOT
-     * textures and the current pixmap is not of POT dimensions.
-     */
-    if (power_of_two && (pow2_width != width || pow2_height != height)) {
-        /*printf("pow2_width: %d, pow2_heigth %d\n", pow2_width, pow2_height); */
+    trace_start = least_time();
+}
 
-        /* Allocate undefined POT texture */
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, pow2_width,
-                 pow2_height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
-                 NULL);
-        DEBUG_GL(glTexImage2D);
+/* Gives the calling thread a buffer, shown as 'name' */
+static void trace_register(const char *name, int id)
+{
+    struct least_trace_buffer *b;
 
-        /* Now fill texture */
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
-            GL_RGBA, GL_UNSIGNED_BYTE, pixmap);
-        DEBUG_GL(glTexSubImage2D);
+    if (!trace_file)
+        return;
 
-    } else {
-        /* NPOT, simply pass pixmap */
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width,
-                 height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
-                 pixmap);
-        DEBUG_GL(glTexImage2D);
+    b = calloc(1, sizeof(struct least_trace_buffer));
+    if (!b || !(b->lock = SDL_CreateMutex())) {
+        fprintf(stderr, "Cannot allocate trace buffer\n");
+        abort();
     }
 
-    /* XXX: This function currently sets the global page size */
-    imw = width;
-    imh = height;
+    b->tid = SDL_ThreadID();
+    if (id < 0)
+        sprintf(b->name, "%.31s", name);
+    else
+        sprintf(b->name, "%.20s %d", name, id);
 
-    return texname;
+    SDL_mutexP(trace_lock);
+    if (trace_buffer_count < TRACE_THREADS)
+        trace_buffers[trace_buffer_count++] = b;
+    SDL_mutexV(trace_lock);
 }
 
-static void quit_tutorial(int code)
+/* Buffer of the calling thread, NULL if it has none. Buffers are only
+ * added, so no lock is needed.
+ */
+static struct least_trace_buffer *trace_buffer(void)
 {
-    unsigned int i;
+    Uint32 tid = SDL_ThreadID();
+    int i;
 
-    for (i = 0; i < pagec; i++)
+    for (i = 0; i < trace_buffer_count; i++)
+        if (trace_buffers[i]->tid == tid)
+            return trace_buffers[i];
+
+    return NULL;
+}
+
+/* Records span 'name' from 'start' to 'end' on the calling thread */
+static void trace_span(const char *name, double start, double end, int arg)
+{
+    struct least_trace_buffer *b;
+    struct least_trace_event *e;
+
+    if (!trace_file || !(b = trace_buffer()))
+        return;
+
+    SDL_mutexP(b->lock);
+
+    if (b->count == b->size && b->size < TRACE_EVENTS_MAX) {
+        b->size = b->size ? b->size * 2 : 1024;
+        b->events = realloc(b->events,
+            sizeof(struct least_trace_event) * b->size);
+        if (!b->events) {
+            fprintf(stderr, "Out of memory while tracing\n");
+            abort();
+        }
+    }
+
+    if (b->count < b->size) {
+        e = b->events + b->count++;
+        e->name = name;
+        e->start = start;
+        e->end = end;
+        e->arg = arg;
+    } else {
+        b->dropped++;
+    }
+
+    SDL_mutexV(b->lock);
+}
+
+/* Start time of a span, 0 if tracing is off */
+static double trace_begin(void)
+{
+    return trace_file ? least_time() : 0;
+}
+
+/* Records span 'name' from 'start', see trace_begin, until now */
+static void trace_end(const char *name, double start, int arg)
+{
+    if (trace_file)
+        trace_span(name, start, least_time(), arg);
+}
+
+static void trace_lock_wait(double start, int lock)
+{
+    double now;
+
+    if (!trace_file)
+        return;
+
+    now = least_time();
+    if (now - start >= TRACE_LOCK_MIN)
+        trace_span("lock wait", start, now, lock);
+}
+
+/* Writes all buffers to trace_file */
+static void trace_write(void)
+{
+    struct least_trace_buffer *b;
+    struct least_trace_event *e;
+    FILE *f;
+    int i, k, events = 0, dropped = 0;
+    const char *sep = "";
+
+    if (!trace_file)
+        return;
+
+    f = fopen(trace_file, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot write trace %s: %s\n", trace_file,
+            strerror(errno));
+        return;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (i = 0; i < trace_buffer_count; i++) {
+        b = trace_buffers[i];
+        SDL_mutexP(b->lock);
+
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", sep, i, b->name);
+        sep = ",\n";
+
+        for (k = 0; k < b->count; k++) {
+            e = b->events + k;
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"least\",\"ph\":\"X\","
+                "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", e->name, i,
+                (e->start - trace_start) * 1e6, (e->end - e->start) * 1e6);
+            if (e->arg >= 0)
+                fprintf(f, ",\"args\":{\"n\":%d}", e->arg);
+            fputc('}', f);
+        }
+
+        events += b->count;
+        dropped += b->dropped;
+        SDL_mutexV(b->lock);
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    if (fclose(f))
+        fprintf(stderr, "Cannot write trace %s: %s\n", trace_file,
+            strerror(errno));
+    else
+        printf("Trace: %d events written to %s, %d dropped\n", events,
+            trace_file, dropped);
+}
+
+static void samples_add(struct least_samples *s, double v)
+{
+    if (s->count == s->size) {
+        s->size = s->size ? s->size * 2 : 64;
+        s->v = realloc(s->v, sizeof(double) * s->size);
+        if (!s->v) {
+            fprintf(stderr, "Out of memory while recording samples\n");
+            abort();
+        }
+    }
+
+    s->v[s->count++] = v;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Returns percentile 'p' (0-100) of the sample set, sorting it in place */
+static double samples_percentile(struct least_samples *s, double p)
+{
+    int i;
+
+    if (!s->count)
+        return 0;
+
+    qsort(s->v, s->count, sizeof(double), compare_double);
+
+    i = ceil(p / 100. * s->count) - 1;
+    if (i < 0)
+        i = 0;
+
+    return s->v[i];
+}
+
+static void print_samples(const char *name, struct least_samples *s)
+{
+    printf("  %-8s %9.2f %9.2f %9.2f %9.2f\n", name,
+        samples_percentile(s, 50) * 1e3,
+        samples_percentile(s, 90) * 1e3,
+        samples_percentile(s, 99) * 1e3,
+        samples_percentile(s, 100) * 1e3);
+}
+
+
+/* Page geometry
+ *
+ * Pages are laid out top to bottom, every page scaled to the render width lw
+ * and followed by PAGE_GAP units of space. 'scroll' is in these units, the
+ * window shows them at view_scale() pixels per unit.
+ *
+ * Pages may differ in size, so the top of every page is kept as a prefix sum
+ * of page aspect ratios, which do not depend on lw. Finding the pages in any
+ * part of the document is a binary search on it.
+ *
+ * The aspect ratios come from a prepass that bounds every page in the
+ * background, see geometry_thread. Until it gets to a page, the page is
+ * assumed to be the size of the first page, or of its last full render.
+ */
+#define PAGE_GAP 20
+
+static double *page_tops; /* Sum of the aspects above every page, pagec + 1 */
+
+/* Prepass results, protected by geometry_lock */
+static SDL_mutex *geometry_lock;
+static float *bound_aspects;
+static int bound_count;     /* Pages bounded so far, in order */
+
+static int bound_applied;   /* Pages of bound_aspects applied to the layout */
+static double geometry_start;
+
+/* Top of 'pagenum' in scroll units, page 'pagec' is the end of the document */
+static float page_top(int pagenum)
+{
+    return page_tops[pagenum] * lw + pagenum * PAGE_GAP;
+}
+
+/* Pixels per unit in the window. Pages are shown 'zoom' times the window
+ * width, whatever width they were rendered at.
+ */
+static float view_scale(void)
+{
+    return w * zoom / lw;
+}
+
+/* Window x of the left edge of the pages, centred unless panned */
+static float view_left(void)
+{
+    return (w - w * zoom) / 2 + pan;
+}
+
+/* Height of 'pagenum' plus the gap below it, in scroll units */
+static float page_span(int pagenum)
+{
+    return page_top(pagenum + 1) - page_top(pagenum);
+}
+
+/* Returns the page at position 'y', clamped to the document */
+static int page_at(float y)
+{
+    int lo = 0, hi = (int)pagec - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (page_top(mid) <= y)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+/* Converts scroll value 's' to a page number plus the fraction of that page
+ * above the top of the window, which survives layout changes.
+ */
+static double scroll_to_position(float s)
+{
+    int pagenum = page_at(-s);
+
+    return pagenum + (-s - page_top(pagenum)) / page_span(pagenum);
+}
+
+static float position_to_scroll(double position)
+{
+    int pagenum = floor(position);
+
+    if (pagenum < 0)
+        pagenum = 0;
+    if (pagenum >= (int)pagec)
+        pagenum = pagec - 1;
+
+    return -(page_top(pagenum) + (position - pagenum) * page_span(pagenum));
+}
+
+/* Scroll value of the page view, which is kept aside in the overview */
+static float *page_view_scroll(void)
+{
+    return overview ? &page_scroll : &scroll;
+}
+
+/* Recomputes the page tops after aspects changed, keeping the page view at
+ * the same position within its top page.
+ */
+static void geometry_rebuild(void)
+{
+    float *s = page_view_scroll();
+    double position = scroll_to_position(*s);
+    unsigned int i;
+
+    for (i = 0; i < pagec; i++)
+        page_tops[i + 1] = page_tops[i] + pages[i].aspect;
+
+    *s = position_to_scroll(position);
+}
+
+/* Returns the aspect of 'pagenum' of 'd', or 0 if it cannot be loaded */
+static float bound_page(fz_context *context, fz_document *d, int pagenum)
+{
+    fz_page *volatile page = NULL;
+    fz_rect bounds;
+
+    fz_try(context) {
+        page = fz_load_page(context, d, pagenum);
+        fz_bound_page(context, page, &bounds);
+    } fz_always(context) {
+        fz_drop_page(context, page);
+    } fz_catch(context) {
+        return 0;
+    }
+
+    return (bounds.y1 - bounds.y0) / (bounds.x1 - bounds.x0);
+}
+
+/* Sets up the layout with every page the size of the first one, of which
+ * 'aspect' is 0 if it cannot be loaded.
+ */
+static void init_geometry(float aspect)
+{
+    unsigned int i;
+
+    page_tops = malloc(sizeof(double) * (pagec + 1));
+    bound_aspects = malloc(sizeof(float) * pagec);
+    geometry_lock = SDL_CreateMutex();
+    if (!page_tops || !bound_aspects || !geometry_lock) {
+        fprintf(stderr, "Cannot allocate page geometry\n");
+        abort();
+    }
+
+    /* Without a first page to go by, assume square pages */
+    bound_aspects[0] = aspect ? aspect : 1;
+    bound_count = bound_applied = 1;
+
+    for (i = 0; i < pagec; i++) {
+        pages[i].aspect = bound_aspects[0];
+        pages[i].bounded = !i;
+    }
+
+    page_tops[0] = 0;
+    for (i = 0; i < pagec; i++)
+        page_tops[i + 1] = page_tops[i] + pages[i].aspect;
+}
+
+/* Applies the prepass results that came in since the last call */
+static void geometry_update(void)
+{
+    int i, count;
+
+    SDL_mutexP(geometry_lock);
+    count = bound_count;
+    for (i = bound_applied; i < count; i++) {
+        pages[i].aspect = bound_aspects[i];
+        pages[i].bounded = 1;
+    }
+    SDL_mutexV(geometry_lock);
+
+    if (count == bound_applied)
+        return;
+
+    bound_applied = count;
+    geometry_rebuild();
+
+    if (count == (int)pagec)
+        least_info("Bounded %u pages in %.2f s\n", pagec,
+            least_time() - geometry_start);
+}
+
+/* Takes the size of a full render of 'pagenum' the prepass has not got to */
+static void geometry_learn(int pagenum, int width, int height)
+{
+    float aspect = (float)height / width;
+
+    if (pages[pagenum].bounded || fabs(aspect - pages[pagenum].aspect) * lw < 1)
+        return;
+
+    pages[pagenum].aspect = aspect;
+    geometry_rebuild();
+}
+
+/* Computes the range of pages [first, last] currently on screen */
+static void visible_range(int *first, int *last)
+{
+    float top = -scroll;
+
+    *first = page_at(top);
+    *last = page_at(top + h / view_scale());
+}
+
+/* Prefetch in the direction of travel
+ *
+ * While the page view scrolls steadily, by autoscroll, keys or dragging, the
+ * prefetch window is moved ahead of the screen. It reaches as far as the view
+ * travels within prefetch_horizon(), so faster scrolling prefetches further.
+ *
+ * Every page ahead gets the time it will scroll into view as its deadline.
+ * A page misses it if nothing of it, not even a preview, is ready by then.
+ */
+#define SCROLL_MOVING 100       /* Slowest travel, in units per second */
+#define SCROLL_SMOOTHING 0.2    /* Time constant of scroll_speed, seconds */
+
+static float scroll_speed;      /* Units per second, positive going down */
+static float scroll_last;       /* Page view scroll at the last track_scroll */
+static double scroll_time;
+static double render_time_avg;  /* Smoothed render time of a page */
+
+/* Statistics */
+static int deadlines_met, deadlines_missed;
+static struct least_samples deadline_lateness;
+static int travel_frames;       /* Frames drawn while travelling */
+static int busy_frames;         /* Those showing a page with nothing ready */
+
+/* Updates scroll_speed from the page view movement since the last call */
+static void track_scroll(void)
+{
+    float s = *page_view_scroll();
+    double now = least_time(), dt = now - scroll_time;
+
+    if (dt <= 0)
+        return;
+
+    /* Jumping more than a screen (Home, End, the overview) is no travel */
+    if (fabs(s - scroll_last) > h / view_scale())
+        scroll_speed = 0;
+    else
+        scroll_speed += ((scroll_last - s) / dt - scroll_speed) * dt /
+            (SCROLL_SMOOTHING + dt);
+
+    scroll_last = s;
+    scroll_time = now;
+}
+
+/* Returns 1 while the page view travels fast enough to prefetch ahead */
+static int travelling(void)
+{
+    return !overview && fabs(scroll_speed) >= SCROLL_MOVING;
+}
+
+/* Seconds of travel to prefetch ahead: a margin for the render threads to
+ * get to the pages, which grows with the time it takes to render one.
+ */
+static double prefetch_horizon(void)
+{
+    return 0.5 + 2 * render_time_avg;
+}
+
+/* Returns when 'pagenum' scrolls into view at the current speed, or 0 if it
+ * is on screen, behind, or the view is not travelling.
+ */
+static double page_deadline(int pagenum)
+{
+    float top = -scroll, bottom = top + h / view_scale();
+    float page_bottom = page_top(pagenum + 1) - PAGE_GAP;
+
+    if (!travelling())
+        return 0;
+
+    if (scroll_speed > 0 && page_top(pagenum) > bottom)
+        return least_time() + (page_top(pagenum) - bottom) / scroll_speed;
+
+    if (scroll_speed < 0 && page_bottom < top)
+        return least_time() + (page_bottom - top) / scroll_speed;
+
+    return 0;
+}
+
+/* Accounts a page getting its first texture now against its 'deadline' */
+static void deadline_account(double deadline)
+{
+    double now = least_time();
+
+    if (!deadline)
+        return;
+
+    if (now <= deadline) {
+        deadlines_met++;
+    } else {
+        deadlines_missed++;
+        samples_add(&deadline_lateness, now - deadline);
+    }
+}
+
+/* Overview geometry
+ *
+ * The overview lays out cells of THUMB_W x THUMB_H plus THUMB_GAP in rows
+ * centered in the window. 'scroll' is in screen pixels while it is shown.
+ */
+#define CELL_W (THUMB_W + THUMB_GAP)
+#define CELL_H (THUMB_H + THUMB_GAP)
+
+static int overview_columns(void)
+{
+    int columns = w / CELL_W;
+
+    return columns > 0 ? columns : 1;
+}
+
+/* Computes the screen position of the cell of 'pagenum' */
+static void overview_cell(int pagenum, float *x, float *y)
+{
+    int columns = overview_columns();
+
+    *x = (w - columns * CELL_W) / 2 + (pagenum % columns) * CELL_W +
+        THUMB_GAP / 2;
+    *y = (pagenum / columns) * CELL_H + THUMB_GAP / 2 + scroll;
+}
+
+/* Returns the page whose cell contains screen position (x, y), or -1 */
+static int overview_page_at(int x, int y)
+{
+    int columns = overview_columns();
+    float cx, cy;
+    int pagenum;
+
+    cx = x - (w - columns * CELL_W) / 2;
+    cy = y - scroll;
+    if (cx < 0 || cx >= columns * CELL_W || cy < 0)
+        return -1;
+
+    pagenum = (int)(cy / CELL_H) * columns + (int)(cx / CELL_W);
+
+    return pagenum < (int)pagec ? pagenum : -1;
+}
+
+/* Computes the range of pages [first, last] on screen in the overview,
+ * 'last' is smaller than 'first' if there are none.
+ */
+static void overview_range(int *first, int *last)
+{
+    int columns = overview_columns();
+    float top = -scroll, bottom = -scroll + h;
+
+    *first = top > 0 ? (int)(top / CELL_H) * columns : 0;
+    *last = bottom > 0 ? ((int)(bottom / CELL_H) + 1) * columns - 1 : -1;
+
+    if (*last >= (int)pagec)
+        *last = pagec - 1;
+}
+
+/* Returns 1 if 'pagenum' is on screen, in the page view or the overview */
+static int page_on_screen(int pagenum)
+{
+    int first, last;
+
+    if (overview)
+        overview_range(&first, &last);
+    else
+        visible_range(&first, &last);
+
+    return pagenum >= first && pagenum <= last;
+}
+
+/* Disk cache (--disk-cache DIR)
+ *
+ * Rendered pages are kept in DIR, one file per page and render size, named
+ * after the MD5 of the document contents so a changed document never hits
+ * stale pages. A file is a header followed by the raw samples, so a hit is
+ * mapped and handed to the upload path as is, or copied straight into the
+ * job's PBO.
+ *
+ * Files are written under a temporary name and renamed, so several least
+ * processes can share DIR. Once the page files in DIR take more than
+ * disk_cache_limit bytes the least recently used ones are deleted, down to
+ * three quarters of it. Other files in DIR are left alone.
+ */
+#define DISK_CACHE_MAGIC "leastpx1"
+
+struct least_disk_header {
+    char magic[8];
+    int width, height;
+    int n;              /* Components per pixel, 1 or 3 */
+};
+
+static char *disk_cache_dir;    /* NULL if disabled */
+static size_t disk_cache_limit = 1024 << 20; /* --disk-cache-mb */
+static char disk_cache_key[33]; /* Hex MD5 of the document */
+
+/* Protected by disk_cache_lock */
+static SDL_mutex *disk_cache_lock;
+static size_t disk_cache_bytes; /* Size of DIR as far as we know */
+static int disk_cache_evicting;
+static int disk_cache_hits, disk_cache_misses;
+
+struct least_disk_file {
+    char name[256];
+    time_t used;
+    size_t size;
+};
+
+static int compare_disk_file(const void *a, const void *b)
+{
+    const struct least_disk_file *x = a, *y = b;
+
+    return x->used < y->used ? -1 : x->used > y->used;
+}
+
+/* Skips the digits at 's', returns NULL if there are none */
+static const char *skip_digits(const char *s)
+{
+    const char *p = s;
+
+    while (*p >= '0' && *p <= '9')
+        p++;
+
+    return p == s ? NULL : p;
+}
+
+/* Returns 1 if 'name' is a page file of any document, see disk_cache_path.
+ * Nothing else in DIR is counted or ever deleted.
+ */
+static int disk_cache_file(const char *name)
+{
+    int i;
+
+    for (i = 0; i < 32; i++)
+        if (!isxdigit((unsigned char)name[i]))
+            return 0;
+
+    name += 32;
+    if (*name++ != '-' || !(name = skip_digits(name)) || *name++ != '-' ||
+            !(name = skip_digits(name)) || *name++ != 'x' ||
+            !(name = skip_digits(name)))
+        return 0;
+
+    return (name[0] == 'g' || name[0] == 'c') && !name[1];
+}
+
+/* Deletes the least recently used page files until DIR fits in the limit */
+static void disk_cache_evict(void)
+{
+    struct least_disk_file *files = NULL;
+    int count = 0, size = 0, i;
+    struct dirent *entry;
+    struct stat st;
+    char path[1024];
+    size_t total = 0;
+    DIR *dir;
+
+    dir = opendir(disk_cache_dir);
+    if (!dir)
+        return;
+
+    while ((entry = readdir(dir))) {
+        /* Skip ., .. and files being written, and anything not ours */
+        if (!disk_cache_file(entry->d_name) ||
+                strlen(entry->d_name) >= sizeof(files->name))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", disk_cache_dir, entry->d_name);
+        if (stat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        if (count == size) {
+            size = size ? size * 2 : 256;
+            files = realloc(files, sizeof(struct least_disk_file) * size);
+            if (!files) {
+                fprintf(stderr, "Out of memory while scanning disk cache\n");
+                abort();
+            }
+        }
+
+        strcpy(files[count].name, entry->d_name);
+        files[count].used = st.st_mtime;
+        files[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    if (total > disk_cache_limit) {
+        qsort(files, count, sizeof(struct least_disk_file),
+            compare_disk_file);
+
+        for (i = 0; i < count && total > disk_cache_limit / 4 * 3; i++) {
+            snprintf(path, sizeof(path), "%s/%s", disk_cache_dir,
+                files[i].name);
+            if (!unlink(path))
+                total -= files[i].size;
+        }
+    }
+
+    free(files);
+
+    SDL_mutexP(disk_cache_lock);
+    disk_cache_bytes = total;
+    disk_cache_evicting = 0;
+    SDL_mutexV(disk_cache_lock);
+}
+
+/* Enables the disk cache for the document 'filename'.
+ * Returns non-zero if it cannot be used.
+ */
+static int init_disk_cache(char *filename)
+{
+    unsigned char buffer[65536], digest[16];
+    fz_md5 md5;
+    size_t len;
+    FILE *f;
+    int i;
+
+    if (mkdir(disk_cache_dir, 0700) && errno != EEXIST) {
+        fprintf(stderr, "Cannot create disk cache %s\n", disk_cache_dir);
+        return 1;
+    }
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot hash: %s\n", filename);
+        return 1;
+    }
+
+    fz_md5_init(&md5);
+    while ((len = fread(buffer, 1, sizeof(buffer), f)))
+        fz_md5_update(&md5, buffer, len);
+    fclose(f);
+    fz_md5_final(&md5, digest);
+
+    for (i = 0; i < 16; i++)
+        sprintf(disk_cache_key + i * 2, "%02x", digest[i]);
+
+    disk_cache_lock = SDL_CreateMutex();
+    if (!disk_cache_lock) {
+        fprintf(stderr, "Mutex initialisation failed: %s\n",
+            SDL_GetError());
+        abort();
+    }
+
+    disk_cache_evicting = 1;
+    disk_cache_evict();
+
+    least_info("Disk cache: %s, %.1f of %.1f MB used\n", disk_cache_dir,
+        disk_cache_bytes / (1024. * 1024.),
+        disk_cache_limit / (1024. * 1024.));
+
+    return 0;
+}
+
+/* The key ends in 'g' if gray pages are kept gray, 'c' if every page is
+ * rendered in colour (--no-gray), so the two never share files
+ */
+static void disk_cache_path(char *path, size_t len, int pagenum,
+        float width, float height)
+{
+    snprintf(path, len, "%s/%s-%d-%dx%d%c", disk_cache_dir, disk_cache_key,
+        pagenum, (int)width, (int)height, detect_gray ? 'g' : 'c');
+}
+
+/* Returns the cached pixmap for 'job', or NULL if it is not cached.
+ *
+ * The pixmap refers to the mapped file, which job_free unmaps, unless the
+ * samples fit in the job's PBO.
+ */
+static fz_pixmap *disk_cache_load(fz_context *context, struct least_job *job)
+{
+    struct least_disk_header *header;
+    unsigned char *samples;
+    fz_pixmap *pixmap;
+    char path[1024];
+    struct stat st;
+    fz_irect bbox;
+    size_t bytes;
+    void *map;
+    int fd;
+
+    disk_cache_path(path, sizeof(path), job->pagenum, job->width,
+        job->height);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        SDL_mutexP(disk_cache_lock);
+        disk_cache_misses++;
+        SDL_mutexV(disk_cache_lock);
+        return NULL;
+    }
+
+    map = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > (off_t)sizeof(*header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        SDL_mutexP(disk_cache_lock);
+        disk_cache_misses++;
+        SDL_mutexV(disk_cache_lock);
+        return NULL;
+    }
+
+    header = map;
+    bytes = (size_t)header->width * header->height * header->n;
+    if (memcmp(header->magic, DISK_CACHE_MAGIC, 8) ||
+            (header->n != 1 && header->n != 3) ||
+            sizeof(*header) + bytes != (size_t)st.st_size) {
+        least_warn("Removing corrupt disk cache file %s\n", path);
+        munmap(map, st.st_size);
+        unlink(path);
+        return NULL;
+    }
+
+    /* Should a gray page turn up anyway, render it in colour */
+    if (!detect_gray && header->n == 1) {
+        munmap(map, st.st_size);
+        SDL_mutexP(disk_cache_lock);
+        disk_cache_misses++;
+        SDL_mutexV(disk_cache_lock);
+        return NULL;
+    }
+
+    /* Mark it recently used */
+    utime(path, NULL);
+
+    bbox.x0 = bbox.y0 = 0;
+    bbox.x1 = header->width;
+    bbox.y1 = header->height;
+
+    samples = (unsigned char *)map + sizeof(*header);
+
+    if (job->pbo && bytes <= job->pbo->size) {
+        memcpy(job->pbo->data, samples, bytes);
+        samples = job->pbo->data;
+    } else {
+        job->map = map;
+        job->map_size = st.st_size;
+    }
+
+    pixmap = fz_new_pixmap_with_bbox_and_data(context,
+        header->n == 1 ? fz_device_gray(context) : fz_device_rgb(context),
+        &bbox, 0, samples);
+
+    if (!job->map)
+        munmap(map, st.st_size);
+
+    SDL_mutexP(disk_cache_lock);
+    disk_cache_hits++;
+    SDL_mutexV(disk_cache_lock);
+
+    return pixmap;
+}
+
+/* Writes all of 'len' bytes of 'data' to 'fd', returns non-zero on error */
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t written;
+
+    while (len) {
+        written = write(fd, p, len);
+        if (written < 0)
+            return 1;
+        p += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+/* Stores the render 'self' kept in self->store in the disk cache.
+ *
+ * This runs after the job went to the main thread, so writing the file and
+ * any eviction do not delay the page reaching the screen. The pixmap has
+ * samples of its own, see render_job, as a PBO mapped for writing cannot
+ * be read back.
+ */
+static void disk_cache_store(struct least_thread *self)
+{
+    fz_context *context = self->context;
+    fz_pixmap *pixmap = self->store;
+    struct least_disk_header header;
+    char path[1024], tmp[1024];
+    size_t bytes;
+    int fd, err, evict;
+
+    memcpy(header.magic, DISK_CACHE_MAGIC, 8);
+    header.width = fz_pixmap_width(context, pixmap);
+    header.height = fz_pixmap_height(context, pixmap);
+    header.n = fz_pixmap_components(context, pixmap);
+    bytes = (size_t)fz_pixmap_stride(context, pixmap) * header.height;
+
+    disk_cache_path(path, sizeof(path), self->store_page, self->store_width,
+        self->store_height);
+    snprintf(tmp, sizeof(tmp), "%s/.%d-%d.tmp", disk_cache_dir,
+        (int)getpid(), self->id);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return;
+
+    err = write_all(fd, &header, sizeof(header)) ||
+        write_all(fd, fz_pixmap_samples(context, pixmap), bytes);
+    err |= close(fd);
+
+    if (err || rename(tmp, path)) {
+        unlink(tmp);
+        return;
+    }
+
+    SDL_mutexP(disk_cache_lock);
+    disk_cache_bytes += sizeof(header) + bytes;
+    evict = disk_cache_bytes > disk_cache_limit && !disk_cache_evicting;
+    if (evict)
+        disk_cache_evicting = 1;
+    SDL_mutexV(disk_cache_lock);
+
+    if (evict)
+        disk_cache_evict();
+}
+
+/* Opens a handle on 'filename' that may only be used with 'context'.
+ * Returns NULL on failure.
+ */
+static fz_document *open_document(fz_context *context, char *filename) {
+    fz_stream *file;
+    fz_document *volatile d = NULL;
+
+    fz_try(context) {
+        file = fz_open_file(context, filename);
+
+        d = (fz_document *) pdf_open_document_with_stream(context, file);
+
+        /* TODO Password */
+
+        fz_drop_stream(context, file);
+    } fz_catch (context) {
+        least_warn("Cannot open: %s\n", filename);
+        d = NULL;
+    }
+
+    return d;
+}
+
+/* Startup
+ *
+ * Opening a large document, counting its pages and hashing it for the disk
+ * cache can take seconds. So it is done by a render thread as a
+ * LEAST_JOB_OPEN, while the window already handles events and shows a busy
+ * page. Until document_ready takes the result pagec is 0, nothing is
+ * scheduled and only Escape works. The first page is then scheduled like any
+ * other visible page.
+ */
+static double open_start;       /* When open_pdf was called */
+static double first_page_time;  /* Seconds from open_start, 0 until shown */
+
+/* Queues opening 'filename', needs the render threads */
+static void open_pdf(char *filename)
+{
+    struct least_job *job = calloc(1, sizeof(struct least_job));
+
+    if (!job) {
+        fprintf(stderr, "Out of memory while opening %s\n", filename);
+        abort();
+    }
+
+    least_info("Opening: %s\n", filename);
+
+    open_start = least_time();
+    doc_filename = filename;
+
+    job->kind = LEAST_JOB_OPEN;
+    job->generation = render_generation;
+    job->queued = open_start;
+
+    SDL_mutexP(queue.lock);
+    queue_push(job);
+    SDL_CondSignal(queue.cond);
+    SDL_mutexV(queue.lock);
+}
+
+/* Runs a LEAST_JOB_OPEN in render thread 'self', which keeps the document
+ * handle for its later jobs.
+ */
+static void document_open(struct least_thread *self, struct least_job *job)
+{
+    fz_context *context = self->context;
+    double t = least_time();
+
+    self->doc = open_document(context, doc_filename);
+    if (!self->doc)
+        return;
+
+    /* The main thread disables the cache, see document_ready */
+    job->disk_cache = disk_cache_dir && !init_disk_cache(doc_filename);
+
+    fz_try(context) {
+        job->page_count = fz_count_pages(context, self->doc);
+    } fz_catch(context) {
+        job->page_count = 0;
+    }
+
+    if (job->page_count)
+        job->aspect = bound_page(context, self->doc, 0);
+    else
+        least_warn("No pages in %s\n", doc_filename);
+
+    job->times.load = least_time() - t;
+    trace_end("open", t, -1);
+}
+
+/* Sets up the pages of the document a LEAST_JOB_OPEN opened and frees the
+ * job. Returns non-zero if it could not be opened.
+ */
+static int document_ready(struct least_job *job)
+{
+    unsigned int i, count = job->page_count;
+    float aspect = job->aspect;
+
+    /* No render job has been queued yet, so none can see the change */
+    if (!job->disk_cache)
+        disk_cache_dir = NULL;
+
+    job_free(job);
+    if (!count)
+        return 1;
+
+    pages = malloc(sizeof(struct least_page_info) * count);
+    if (!pages) {
+        fprintf(stderr, "Cannot allocate %u pages\n", count);
+        abort();
+    }
+
+    for(i = 0; i < count; i++) {
+        pages[i].rendering = 0;
+        pages[i].previewing = 0;
+        pages[i].preview = 0;
+        pages[i].thumbing = 0;
+        pages[i].thumb = 0;
+        pages[i].texture = 0;
+        pages[i].indexing = 0;
+        pages[i].failed = 0;
+        pages[i].text = NULL;
+        pages[i].links = NULL;
+    }
+
+    pagec = count;
+    init_geometry(aspect);
+
+    least_info("Done opening in %.0f ms\n",
+        (least_time() - open_start) * 1e3);
+    return 0;
+}
+
+/* Display list cache
+ *
+ * Display lists are built in page space, so they stay valid for any render
+ * scale. Keeping the most recently used ones around means a re-render (zoom,
+ * scrolling back) only pays for rasterization and skips loading and
+ * interpreting the page.
+ *
+ * Every entry owns one reference to its list. Renderers take their own
+ * reference, so an entry can be evicted while its list is still in use.
+ * Lists are shared between threads: a list recorded from one thread's
+ * document handle may be run and dropped by any other thread.
+ */
+struct least_list_entry {
+    int pagenum;            /* -1 if unused */
+    fz_display_list *list;
+    fz_rect bounds;         /* Unscaled page bounds */
+    int color;              /* See list_is_color */
+    unsigned int used;      /* LRU stamp */
+};
+
+static int list_cache_size = 32; /* Entries, 0 disables (--list-cache) */
+static struct least_list_entry *list_cache;
+static unsigned int list_cache_clock;
+static SDL_mutex *list_cache_lock;
+
+/* Statistics, protected by list_cache_lock */
+static int list_cache_hits, list_cache_misses;
+
+static void init_list_cache(void)
+{
+    int i;
+
+    list_cache_lock = SDL_CreateMutex();
+    if (!list_cache_lock) {
+        fprintf(stderr, "Mutex initialisation failed: %s\n",
+            SDL_GetError());
+        abort();
+    }
+
+    if (!list_cache_size)
+        return;
+
+    list_cache = malloc(sizeof(struct least_list_entry) * list_cache_size);
+    if (!list_cache) {
+        fprintf(stderr, "Cannot allocate display list cache\n");
+        abort();
+    }
+
+    for (i = 0; i < list_cache_size; i++) {
+        list_cache[i].pagenum = -1;
+        list_cache[i].list = NULL;
+        list_cache[i].used = 0;
+    }
+}
+
+/* Must be called with list_cache_lock held */
+static struct least_list_entry *list_cache_find(int pagenum)
+{
+    int i;
+
+    for (i = 0; i < list_cache_size; i++)
+        if (list_cache[i].pagenum == pagenum)
+            return list_cache + i;
+
+    return NULL;
+}
+
+/* Returns a new reference to the cached display list of 'pagenum' and
+ * stores its bounds and colour flag, or NULL if the page is not cached.
+ */
+static fz_display_list *list_cache_get(fz_context *context, int pagenum,
+        fz_rect *bounds, int *color)
+{
+    struct least_list_entry *e;
+    fz_display_list *list = NULL;
+
+    SDL_mutexP(list_cache_lock);
+
+    e = list_cache_find(pagenum);
+    if (e) {
+        list = fz_keep_display_list(context, e->list);
+        *bounds = e->bounds;
+        *color = e->color;
+        e->used = ++list_cache_clock;
+        list_cache_hits++;
+    } else {
+        list_cache_misses++;
+    }
+
+    SDL_mutexV(list_cache_lock);
+
+    return list;
+}
+
+/* Adds 'list' to the cache, evicting the least recently used entry */
+static void list_cache_put(fz_context *context, int pagenum,
+        fz_display_list *list, const fz_rect *bounds, int color)
+{
+    struct least_list_entry *e;
+    fz_display_list *old;
+    int i;
+
+    if (!list_cache_size)
+        return;
+
+    SDL_mutexP(list_cache_lock);
+
+    /* Another thread may have built the same page in the meantime */
+    if (list_cache_find(pagenum)) {
+        SDL_mutexV(list_cache_lock);
+        return;
+    }
+
+    e = list_cache;
+    for (i = 1; i < list_cache_size; i++)
+        if (list_cache[i].used < e->used)
+            e = list_cache + i;
+
+    old = e->list;
+    if (old)
+        least_debug("list cache: Evicting page %d\n", e->pagenum);
+
+    e->pagenum = pagenum;
+    e->list = fz_keep_display_list(context, list);
+    e->bounds = *bounds;
+    e->color = color;
+    e->used = ++list_cache_clock;
+
+    SDL_mutexV(list_cache_lock);
+
+    if (old)
+        fz_drop_display_list(context, old);
+}
+
+/* Returns 1 if the page recorded in 'list' uses colour.
+ *
+ * Gray pages are rendered and uploaded with a single channel, a quarter of
+ * the memory of RGBA. Images are not inspected pixel by pixel, which would
+ * cost about as much as rendering them; any image with a colour colorspace
+ * makes the page a colour page.
+ */
+static int list_is_color(fz_context *context, fz_display_list *list,
+        fz_cookie *cookie)
+{
+    fz_device *volatile dev = NULL;
+    int is_color = 0;
+
+    if (!detect_gray)
+        return 1;
+
+    fz_try(context) {
+        dev = fz_new_test_device(context, &is_color, 0.02f, 0, NULL);
+        fz_run_display_list(context, list, dev, &fz_identity,
+            &fz_infinite_rect, cookie);
+    } fz_always(context) {
+        fz_drop_device(context, dev);
+    } fz_catch(context) {
+        /* The test device stops at the first colour it finds */
+        is_color = 1;
+    }
+
+    return is_color;
+}
+
+/* Band rasterization
+ *
+ * A page's display list can be split into horizontal bands rasterized by
+ * several render threads into one shared pixmap. The thread owning the page
+ * queues a band ticket for every other band; idle threads that pop a ticket
+ * claim the next unclaimed band. The owner claims bands too, so the page
+ * completes even if no other thread is free to help.
+ */
+struct least_band_set {
+    fz_display_list *list;
+    fz_pixmap *pixmap;
+    fz_matrix ctm;
+    fz_cookie *cookie;
+
+    /* Protected by queue.lock */
+    int count;  /* Number of bands */
+    int next;   /* Next band to claim */
+    int done;   /* Bands rasterized */
+    int failed; /* Set if any band could not be rasterized */
+};
+
+/* Returns the next band to rasterize, or -1 if all are claimed.
+ *
+ * Must be called with queue.lock held.
+ */
+static int band_claim(struct least_band_set *set)
+{
+    if (set->next >= set->count)
+        return -1;
+
+    return set->next++;
+}
+
+/* Returns non-zero if the band could not be rasterized */
+static int rasterize_band(fz_context *context, struct least_band_set *set,
+        int band)
+{
+    fz_pixmap *volatile pix = NULL;
+    fz_device *volatile dev = NULL;
+    fz_irect bbox;
+    fz_rect area;
+    int band_h, failed = 0;
+    double t = trace_begin();
+
+    /* The band is a view on rows of the shared pixmap */
+    bbox.x0 = 0;
+    bbox.x1 = fz_pixmap_width(context, set->pixmap);
+    band_h = (fz_pixmap_height(context, set->pixmap) + set->count - 1) /
+        set->count;
+    bbox.y0 = band * band_h;
+    bbox.y1 = bbox.y0 + band_h;
+    if (bbox.y1 > fz_pixmap_height(context, set->pixmap))
+        bbox.y1 = fz_pixmap_height(context, set->pixmap);
+    if (bbox.y0 >= bbox.y1)
+        return 0;
+
+    fz_try(context) {
+        pix = fz_new_pixmap_with_bbox_and_data(context,
+            fz_pixmap_colorspace(context, set->pixmap), &bbox,
+            fz_pixmap_alpha(context, set->pixmap),
+            fz_pixmap_samples(context, set->pixmap) +
+                bbox.y0 * fz_pixmap_stride(context, set->pixmap));
+
+        fz_clear_pixmap_with_value(context, pix, 255);
+
+        dev = fz_new_draw_device(context, &fz_identity, pix);
+        fz_rect_from_irect(&area, &bbox);
+        fz_run_display_list(context, set->list, dev, &set->ctm, &area,
+            set->cookie);
+    } fz_always(context) {
+        fz_drop_device(context, dev);
+
+        /* Does not free the samples, they belong to the shared pixmap */
+        fz_drop_pixmap(context, pix);
+    } fz_catch(context) {
+        failed = 1;
+    }
+
+    trace_end("band", t, band);
+
+    return failed;
+}
+
+/* Rasterizes 'list' into 'image' in 'bands' bands, helped by idle threads.
+ * Returns non-zero if any band failed.
+ */
+static int rasterize_bands(fz_context *context, fz_display_list *list,
+        fz_pixmap *image, const fz_matrix *ctm, int bands, fz_cookie *cookie)
+{
+    struct least_band_set set;
+    struct least_job *ticket;
+    int i, band, failed;
+
+    set.list = list;
+    set.pixmap = image;
+    set.ctm = *ctm;
+    set.cookie = cookie;
+    set.count = bands;
+    set.next = 0;
+    set.done = 0;
+    set.failed = 0;
+
+    SDL_mutexP(queue.lock);
+
+    for (i = 1; i < bands; i++) {
+        ticket = malloc(sizeof(struct least_job));
+        if (!ticket) {
+            fprintf(stderr, "Out of memory while queueing bands\n");
+            abort();
+        }
+        memset(ticket, 0, sizeof(struct least_job));
+        ticket->pagenum = -1;
+        ticket->priority = -1;
+        ticket->bands = &set;
+        queue_push(ticket);
+    }
+    SDL_CondBroadcast(queue.cond);
+
+    while ((band = band_claim(&set)) >= 0) {
+        SDL_mutexV(queue.lock);
+        failed = rasterize_band(context, &set, band);
+        SDL_mutexP(queue.lock);
+        set.failed |= failed;
+        set.done++;
+    }
+
+    /* Take back tickets nobody picked up, 'set' is about to go away */
+    for (i = 0; i < queue.count; ) {
+        if (queue.heap[i]->bands == &set) {
+            free(queue.heap[i]);
+            queue.heap[i] = queue.heap[--queue.count];
+        } else {
+            i++;
+        }
+    }
+    queue_heapify();
+
+    /* Wait for bands claimed by other threads */
+    while (set.done < set.count)
+        SDL_CondWait(band_cond, queue.lock);
+
+    SDL_mutexV(queue.lock);
+
+    return set.failed;
+}
+
+/* Link index
+ *
+ * The links of a page are gathered whenever the page is loaded, by a render
+ * job or by text extraction, and resolved to their target right away. They
+ * are kept in a bounding volume hierarchy, so hit testing the mouse position
+ * visits O(log n) nodes however many links the page has.
+ */
+#define LINK_LEAF 4     /* Links per leaf node */
+
+struct least_link {
+    fz_rect rect;       /* In points on the page */
+    int target;         /* Page number, -1 for external links */
+    float target_y;     /* In points on the target page */
+    char *uri;          /* External links only */
+};
+
+/* Leaves hold 'count' links from 'first', inner nodes have no links and two
+ * children from 'child'
+ */
+struct least_link_node {
+    fz_rect box;
+    int first, count;
+    int child;
+};
+
+struct least_page_links {
+    float width;        /* Page width in points */
+    int count, node_count;
+    struct least_link *links;
+    struct least_link_node *nodes;
+};
+
+/* Target page of the link under the mouse, rendered ahead so following the
+ * link is instant. -1 for none.
+ */
+static int link_prefetch = -1;
+
+/* Statistics, only touched by the main thread */
+static int link_clicks;         /* Internal links followed */
+static int link_clicks_ready;   /* Of those, target page already rendered */
+
+static int compare_link_x(const void *a, const void *b)
+{
+    const struct least_link *x = a, *y = b;
+    float d = (x->rect.x0 + x->rect.x1) - (y->rect.x0 + y->rect.x1);
+
+    return d < 0 ? -1 : d > 0;
+}
+
+static int compare_link_y(const void *a, const void *b)
+{
+    const struct least_link *x = a, *y = b;
+    float d = (x->rect.y0 + x->rect.y1) - (y->rect.y0 + y->rect.y1);
+
+    return d < 0 ? -1 : d > 0;
+}
+
+/* Builds node 'index' over 'count' links from 'first', splitting them at the
+ * median along the longer side of their bounds
+ */
+static void link_build(struct least_page_links *pl, int index, int first,
+        int count)
+{
+    struct least_link_node *node = pl->nodes + index;
+    int i, half;
+
+    node->box = pl->links[first].rect;
+    for (i = first + 1; i < first + count; i++)
+        fz_union_rect(&node->box, &pl->links[i].rect);
+
+    node->first = first;
+    node->count = count;
+    if (count <= LINK_LEAF)
+        return;
+
+    qsort(pl->links + first, count, sizeof(struct least_link),
+        node->box.x1 - node->box.x0 > node->box.y1 - node->box.y0 ?
+        compare_link_x : compare_link_y);
+
+    node->count = 0;
+    node->child = pl->node_count;
+    pl->node_count += 2;
+
+    half = count / 2;
+    link_build(pl, node->child, first, half);
+    link_build(pl, node->child + 1, first + half, count - half);
+}
+
+/* Resolves the links of 'head' into 'pl' */
+static void links_resolve(fz_context *context, fz_document *doc,
+        struct least_page_links *pl, fz_link *head)
+{
+    struct least_link *l;
+    fz_link *link;
+    float x, y;
+    int n = 0;
+
+    for (link = head; link; link = link->next)
+        n++;
+
+    pl->links = malloc(sizeof(struct least_link) * (n ? n : 1));
+    pl->nodes = malloc(sizeof(struct least_link_node) * (n * 2 + 1));
+    if (!pl->links || !pl->nodes) {
+        fprintf(stderr, "Out of memory while loading links\n");
+        abort();
+    }
+
+    for (link = head; link; link = link->next) {
+        if (!link->uri)
+            continue;
+
+        l = pl->links + pl->count;
+        l->rect = link->rect;
+        l->uri = NULL;
+        l->target_y = 0;
+
+        if (fz_is_external_link(context, link->uri)) {
+            l->target = -1;
+            l->uri = malloc(strlen(link->uri) + 1);
+            if (!l->uri) {
+                fprintf(stderr, "Out of memory while loading links\n");
+                abort();
+            }
+            strcpy(l->uri, link->uri);
+        } else {
+            l->target = fz_resolve_link(context, doc, link->uri, &x, &y);
+            if (l->target < 0 || l->target >= (int)pagec)
+                continue;
+            l->target_y = y;
+        }
+
+        pl->count++;
+    }
+}
+
+/* Returns the link index of 'page', which is 'width' points wide. A page
+ * whose links fail to load gets the links resolved until then.
+ */
+static struct least_page_links *load_links(fz_context *context,
+        fz_document *doc, fz_page *page, float width)
+{
+    struct least_page_links *pl = malloc(sizeof(struct least_page_links));
+    fz_link *volatile head = NULL;
+
+    if (!pl) {
+        fprintf(stderr, "Out of memory while loading links\n");
+        abort();
+    }
+
+    pl->width = width;
+    pl->count = 0;
+    pl->node_count = 1;
+    pl->links = NULL;
+    pl->nodes = NULL;
+
+    fz_try(context) {
+        head = fz_load_links(context, page);
+        links_resolve(context, doc, pl, head);
+    } fz_always(context) {
+        fz_drop_link(context, head);
+    } fz_catch(context) {
+        least_warn("Cannot load the links of a page\n");
+    }
+
+    if (pl->count)
+        link_build(pl, 0, 0, pl->count);
+
+    return pl;
+}
+
+static void links_free(struct least_page_links *pl)
+{
+    int i;
+
+    if (!pl)
+        return;
+
+    for (i = 0; i < pl->count; i++)
+        free(pl->links[i].uri);
+
+    free(pl->links);
+    free(pl->nodes);
+    free(pl);
+}
+
+/* Loads page 'pagenum' only for its link index, for renders that do not load
+ * the page, like disk cache hits. Returns NULL if the page cannot be loaded.
+ */
+static struct least_page_links *page_links(fz_context *context,
+        fz_document *doc, int pagenum)
+{
+    fz_page *volatile page = NULL;
+    struct least_page_links *volatile pl = NULL;
+    fz_rect bounds;
+
+    fz_try(context) {
+        page = fz_load_page(context, doc, pagenum);
+        fz_bound_page(context, page, &bounds);
+        pl = load_links(context, doc, page, bounds.x1);
+    } fz_always(context) {
+        fz_drop_page(context, page);
+    } fz_catch(context) {
+        least_warn("Cannot load the links of page %d\n", pagenum);
+    }
+
+    return pl;
+}
+
+/* Returns the link of 'pl' at ('x', 'y'), in points, or NULL */
+static struct least_link *link_at(struct least_page_links *pl, float x,
+        float y)
+{
+    struct least_link_node *node;
+    struct least_link *l;
+    int stack[64], top = 0, i;
+
+    if (!pl->count)
+        return NULL;
+
+    stack[top++] = 0;
+    while (top) {
+        node = pl->nodes + stack[--top];
+        if (x < node->box.x0 || x > node->box.x1 ||
+                y < node->box.y0 || y > node->box.y1)
+            continue;
+
+        if (!node->count) {
+            stack[top++] = node->child;
+            stack[top++] = node->child + 1;
+            continue;
+        }
+
+        for (i = node->first; i < node->first + node->count; i++) {
+            l = pl->links + i;
+            if (x >= l->rect.x0 && x <= l->rect.x1 &&
+                    y >= l->rect.y0 && y <= l->rect.y1)
+                return l;
+        }
+    }
+
+    return NULL;
+}
+
+/* This function renders the given PDF page and returns it as a pixmap
+ *
+ * This code is reentrant given 'context' and 'doc' are not currently in use
+ * in any other thread. Every render thread owns its own context and
+ * document handle for this purpose.
+ *
+ * If 'bands' is larger than 1, rasterization is split into that many bands
+ * that idle render threads help with. Only render threads may do this.
+ *
+ * The page is scaled to 'width', or less if it would be taller than 'height'
+ * otherwise. A 'height' of 0 does not limit the height.
+ *
+ * The pixmap is rasterized into 'dest' if it fits in 'dest_size' bytes,
+ * otherwise it allocates its own samples.
+ *
+ * Rendering stops early when 'cookie' (may be NULL) is aborted from another
+ * thread, NULL is returned in that case.
+ *
+ * If the page has to be loaded and 'links' is not NULL, its link index is
+ * stored there, otherwise NULL.
+ */
+static fz_pixmap *page_to_pixmap(fz_context *context, fz_document *doc,
+        int pagenum, float width, float height, int bands, fz_cookie *cookie,
+        unsigned char *dest, size_t dest_size,
+        struct least_page_links **links, struct least_render_times *times) {
+    fz_page *volatile page = NULL;
+    fz_display_list *volatile list = NULL;
+    fz_pixmap *volatile image = NULL;
+    fz_device *volatile dev = NULL;
+    fz_rect bounds;
+    fz_irect bbox;
+    fz_matrix ctm;
+    fz_colorspace *cspace;
+    float scale;
+    double t0, t1, t2;
+    int color;
+    volatile int failed = 0;
+
+    least_debug("Rendering page %d\n", pagenum);
+
+    t0 = t1 = t2 = least_time();
+
+    if (links)
+        *links = NULL;
+
+    fz_try(context) {
+        list = list_cache_get(context, pagenum, &bounds, &color);
+        if (!list) {
+            page = fz_load_page(context, doc, pagenum);
+
+            fz_bound_page(context, page, &bounds);
+
+            if (links)
+                *links = load_links(context, doc, page, bounds.x1);
+
+            t1 = least_time();
+
+            list = fz_new_display_list(context, &bounds);
+            dev = fz_new_list_device(context, list);
+            /* fz_run_page(doc, page, dev, ctm, NULL); */
+            fz_run_page(context, page, dev, &fz_identity, cookie);
+            fz_drop_device(context, dev);
+            dev = NULL;
+
+            /* The display list does not refer to the page */
+            fz_drop_page(context, page);
+            page = NULL;
+
+            color = list_is_color(context, list, cookie);
+
+            t2 = least_time();
+
+            trace_span("load", t0, t1, pagenum);
+            trace_span("list", t1, t2, pagenum);
+
+            /* An aborted list is incomplete, never cache it */
+            if (cookie && cookie->abort)
+                least_debug("Page %d: cancelled while building list\n",
+                    pagenum);
+            else
+                list_cache_put(context, pagenum, list, &bounds, color);
+        } else {
+            least_debug("Page %d: display list cache hit\n", pagenum);
+        }
+
+        if (times) {
+            times->load = t1 - t0;
+            times->list = t2 - t1;
+        }
+
+        if (!cookie || !cookie->abort) {
+            scale = width / bounds.x1;
+            if (height && bounds.y1 * scale > height)
+                scale = height / bounds.y1;
+            least_debug("Width: %f\n", width);
+            least_debug("Scale: %f\n", scale);
+
+            fz_scale(&ctm, scale, scale);
+
+            bounds.x1 *= scale;
+            bounds.y1 *= scale;
+
+            fz_round_rect(&bbox, &bounds);
+            least_debug("Size: (%d, %d)\n", bbox.x1, bbox.y1);
+
+            t2 = least_time();
+
+            /* Rasterize. Pages are opaque, so there is no alpha channel, and
+             * gray pages get a single channel.
+             */
+            cspace = color ? fz_device_rgb(context) : fz_device_gray(context);
+            if (dest && (size_t)(bbox.x1 - bbox.x0) * (bbox.y1 - bbox.y0) *
+                    (color ? 3 : 1) <= dest_size)
+                image = fz_new_pixmap_with_bbox_and_data(context, cspace,
+                    &bbox, 0, dest);
+            else
+                image = fz_new_pixmap_with_bbox(context, cspace, &bbox, 0);
+
+            if (bands > 1 && bbox.y1 - bbox.y0 >= bands) {
+                failed = rasterize_bands(context, list, image, &ctm, bands,
+                    cookie);
+            } else {
+                dev = fz_new_draw_device(context, &fz_identity, image);
+                fz_clear_pixmap_with_value(context, image, 255);
+
+                /* XXX: Before mupdf >=1.2 it was:
+                 * fz_run_display_list(list, dev, &ctm, &bbox, NULL);*/
+                fz_run_display_list(context, list, dev, &ctm, &bounds,
+                    cookie);
+            }
+
+            if (times)
+                times->raster = least_time() - t2;
+            trace_end("raster", t2, pagenum);
+        }
+    } fz_always(context) {
+        fz_drop_device(context, dev);
+        fz_drop_page(context, page);
+
+        /* Reference counting is protected by least_context_locks, so this
+         * is safe even if the cache has evicted the list in the meantime.
+         */
+        fz_drop_display_list(context, list);
+    } fz_catch(context) {
+        failed = 1;
+    }
+
+    /* A damaged page only costs its own render, see render_job */
+    if (failed) {
+        least_warn("Cannot render page %d\n", pagenum);
+        fz_drop_pixmap(context, image);
+        return NULL;
+    }
+
+    if (cookie && cookie->abort) {
+        least_debug("Page %d: cancelled while rasterizing\n", pagenum);
+        fz_drop_pixmap(context, image);
+        return NULL;
+    }
+
+    return image;
+}
+
+/* Text index
+ *
+ * Idle render threads extract the text of every page in the background, see
+ * update_cache. A page is indexed as one string of lower case UCS-2
+ * characters with a space after every line, so searching it is a plain scan.
+ * For highlighting, every character keeps its horizontal extent and every
+ * line its vertical one, in page space. That is 6 bytes per character and
+ * 12 per line, a few MB for a long document.
+ */
+#define TEXT_UNITS 4    /* Character positions per point */
+
+struct least_text_line {
+    float y0, y1;
+    int first;          /* Index of the first character of the line */
+};
+
+struct least_page_text {
+    float width;        /* Page width in points */
+    int len, line_count;
+    unsigned short *text;
+    unsigned short *x;  /* x0 and x1 of every character, in TEXT_UNITS */
+    struct least_text_line *lines;
+    size_t size;        /* Bytes allocated, including this structure */
+};
+
+/* Indexing state, only touched by the main thread */
+static int text_jobs;               /* LEAST_JOB_TEXT queued or running */
+static int text_next;               /* First page not considered yet */
+
+/* Statistics, only touched by the main thread */
+static unsigned int text_indexed;   /* Pages with a text index */
+static size_t text_bytes;           /* Held by the text index */
+
+/* Maps 'c' to the character stored in the index, folding case. Folding
+ * follows LC_CTYPE, which main takes from the environment.
+ */
+static unsigned short text_fold(int c)
+{
+    if (c == '\t' || c == 0xa0)
+        return ' ';
+
+    if (c > 0xffff)
+        return 0xfffd;
+
+    return towlower(c);
+}
+
+static void text_put(struct least_page_text *t, int c, float x0, float x1)
+{
+    x0 *= TEXT_UNITS;
+    x1 *= TEXT_UNITS;
+
+    t->text[t->len] = text_fold(c);
+    t->x[t->len * 2] = x0 < 0 ? 0 : x0 > 65535 ? 65535 : x0;
+    t->x[t->len * 2 + 1] = x1 < 0 ? 0 : x1 > 65535 ? 65535 : x1;
+    t->len++;
+}
+
+/* Spans of a line, last_span is not necessarily the end of the list */
+#define NEXT_SPAN(LINE, SPAN) \
+    ((SPAN) == (LINE)->last_span ? NULL : (SPAN)->next)
+
+/* Builds the index of 'stext', which may be NULL for an empty page */
+static struct least_page_text *text_index(fz_context *context,
+        fz_stext_page *stext, float width)
+{
+    struct least_page_text *t;
+    struct least_text_line *l;
+    fz_stext_block *block;
+    fz_stext_line *line;
+    fz_stext_span *span;
+    fz_rect r;
+    size_t size;
+    int b, i, k, len = 0, line_count = 0;
+
+    /* Count first, so the index is allocated in one piece */
+    for (b = 0; stext && b < stext->len; b++) {
+        if (stext->blocks[b].type != FZ_PAGE_BLOCK_TEXT)
+            continue;
+
+        block = stext->blocks[b].u.text;
+        for (i = 0; i < block->len; i++) {
+            line = block->lines + i;
+            for (span = line->first_span; span; span = NEXT_SPAN(line, span))
+                len += span->len;
+
+            len++;
+            line_count++;
+        }
+    }
+
+    size = sizeof(struct least_page_text) +
+        sizeof(struct least_text_line) * line_count +
+        sizeof(unsigned short) * 3 * len;
+    t = malloc(size);
+    if (!t) {
+        fprintf(stderr, "Out of memory while indexing text\n");
+        abort();
+    }
+
+    t->width = width;
+    t->len = 0;
+    t->line_count = 0;
+    t->lines = (struct least_text_line *)(t + 1);
+    t->x = (unsigned short *)(t->lines + line_count);
+    t->text = t->x + len * 2;
+    t->size = size;
+
+    for (b = 0; stext && b < stext->len; b++) {
+        if (stext->blocks[b].type != FZ_PAGE_BLOCK_TEXT)
+            continue;
+
+        block = stext->blocks[b].u.text;
+        for (i = 0; i < block->len; i++) {
+            line = block->lines + i;
+            l = t->lines + t->line_count++;
+            l->first = t->len;
+            l->y0 = l->y1 = 0;
+
+            for (span = line->first_span; span;
+                    span = NEXT_SPAN(line, span)) {
+                for (k = 0; k < span->len; k++) {
+                    fz_stext_char_bbox(context, &r, span, k);
+                    if (t->len == l->first || r.y0 < l->y0)
+                        l->y0 = r.y0;
+                    if (t->len == l->first || r.y1 > l->y1)
+                        l->y1 = r.y1;
+                    text_put(t, span->text[k].c, r.x0, r.x1);
+                }
+            }
+
+            /* Join lines, so matches may cross them */
+            r.x1 = t->len > l->first ?
+                t->x[t->len * 2 - 1] / (float)TEXT_UNITS : 0;
+            text_put(t, ' ', r.x1, r.x1);
+        }
+    }
+
+    return t;
+}
+
+/* Extracts the text of 'pagenum' and returns its index.
+ *
+ * Reentrant like page_to_pixmap. A cached display list is reused, but a list
+ * built here is not cached: indexing runs through the whole document and
+ * would flush the lists of the pages on screen. Pages that fail to load get
+ * an empty index. NULL is returned if 'cookie' aborted extraction.
+ *
+ * Links are stored in 'links' like page_to_pixmap does.
+ */
+static struct least_page_text *page_to_text(fz_context *context,
+        fz_document *doc, int pagenum, fz_cookie *cookie,
+        struct least_page_links **links)
+{
+    fz_stext_sheet *volatile sheet = NULL;
+    fz_stext_page *volatile stext = NULL;
+    fz_device *volatile dev = NULL;
+    fz_page *volatile page = NULL;
+    fz_display_list *list;
+    fz_rect bounds;
+    struct least_page_text *t = NULL;
+    int color;
+    double start = trace_begin();
+
+    least_debug("Indexing text of page %d\n", pagenum);
+
+    *links = NULL;
+    list = list_cache_get(context, pagenum, &bounds, &color);
+
+    fz_try(context) {
+        if (!list) {
+            page = fz_load_page(context, doc, pagenum);
+            fz_bound_page(context, page, &bounds);
+            *links = load_links(context, doc, page, bounds.x1);
+        }
+
+        sheet = fz_new_stext_sheet(context);
+        stext = fz_new_stext_page(context, &bounds);
+        dev = fz_new_stext_device(context, sheet, stext, NULL);
+        if (list)
+            fz_run_display_list(context, list, dev, &fz_identity,
+                &fz_infinite_rect, cookie);
+        else
+            fz_run_page(context, page, dev, &fz_identity, cookie);
+        fz_close_device(context, dev);
+    } fz_always(context) {
+        fz_drop_device(context, dev);
+        fz_drop_page(context, page);
+        fz_drop_display_list(context, list);
+    } fz_catch(context) {
+        least_warn("Cannot extract the text of page %d\n", pagenum);
+        fz_drop_stext_page(context, stext);
+        stext = NULL;
+    }
+
+    if (!cookie || !cookie->abort)
+        t = text_index(context, stext, stext ? bounds.x1 : 0);
+
+    fz_drop_stext_page(context, stext);
+    fz_drop_stext_sheet(context, sheet);
+
+    trace_end("text", start, pagenum);
+
+    return t;
+}
+
+#if 0
+#define DEBUG_GL(STR) \
+    printf("OpenGL error " #STR ": %s\n", gluErrorString(glGetError()))
+#else
+#define DEBUG_GL(STR)
+#endif
+
+/* Get next power of 2 */
+#define NPOW2(D, S) \
+    { \
+        D = S; \
+        D |= D >> 1; \
+        D |= D >> 2; \
+        D |= D >> 4; \
+        D |= D >> 8; \
+        D |= D >> 16; \
+        D++; \
+    }
+
+/* Round up to power of 2 */
+#define RPOW2(D, S) \
+    { \
+        NPOW2(D, S); \
+        D = D == S << 1 ? S : D; \
+    }
+
+/* Bytes per pixel of a texture in 'format' */
+static int format_bytes(int format)
+{
+    switch (format) {
+    case GL_LUMINANCE:
+        return 1;
+    case GL_RGB:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+/* GPU memory held by a texture for 'format' pixmaps of 'width' x 'height',
+ * mipmaps add a third
+ */
+static size_t texture_size(int width, int height, int format)
+{
+    size_t bytes = (size_t)width * height * format_bytes(format);
+
+    return use_mipmap ? bytes + bytes / 3 : bytes;
+}
+
+/* Texture pool
+ *
+ * Page textures come in only a few sizes, so instead of deleting the texture
+ * of a page leaving the cache and allocating a new one for the next page,
+ * released textures are kept in a pool and refilled with glTexSubImage2D.
+ * This avoids driver allocation stalls while scrolling and keeps GPU memory
+ * flat. The pool holds at most as many textures as the prefetch window, and
+ * counts against texture_budget: page textures and pooled ones together
+ * never hold more than the budget, pooled ones give way first.
+ */
+struct least_pooled_texture {
+    GLuint name;
+    int w, h;   /* Size of the pixmaps it was allocated for */
+    int format; /* GL format it was allocated with */
+};
+
+static struct least_pooled_texture *texture_pool; /* Oldest first */
+static int texture_pool_count, texture_pool_size;
+static size_t texture_pool_bytes;   /* Held by pooled textures */
+
+/* Statistics */
+static int textures_allocated, textures_reused;
+
+static void init_texture_pool(void)
+{
+    texture_pool_size = prefetch_pages;
+    texture_pool_count = 0;
+
+    texture_pool = malloc(sizeof(struct least_pooled_texture) *
+        texture_pool_size);
+    if (!texture_pool) {
+        fprintf(stderr, "Cannot allocate texture pool\n");
+        abort();
+    }
+}
+
+/* Deletes the oldest texture in the pool */
+static void texture_pool_drop(void)
+{
+    texture_pool_bytes -= texture_size(texture_pool[0].w, texture_pool[0].h,
+        texture_pool[0].format);
+    glDeleteTextures(1, &texture_pool[0].name);
+    memmove(texture_pool, texture_pool + 1,
+        sizeof(struct least_pooled_texture) * --texture_pool_count);
+}
+
+/* Deletes the oldest pooled textures until they fit in texture_budget
+ * beside the page textures
+ */
+static void texture_pool_trim(void)
+{
+    while (texture_pool_count &&
+            texture_bytes + texture_pool_bytes > texture_budget)
+        texture_pool_drop();
+}
+
+/* Returns a texture for 'format' pixmaps of 'width' x 'height' with
+ * undefined contents, reusing a pooled one if possible.
+ *
+ * Must be called with no PBO bound, as a texture is allocated from a NULL
+ * pointer.
+ */
+static GLuint texture_get(int width, int height, int format)
+{
+    unsigned int texname;
+    int pow2_width, pow2_height;
+    int i;
+
+    for (i = texture_pool_count - 1; i >= 0; i--) {
+        if (texture_pool[i].w == width && texture_pool[i].h == height &&
+                texture_pool[i].format == format) {
+            texname = texture_pool[i].name;
+            texture_pool_bytes -= texture_size(width, height, format);
+            memmove(texture_pool + i, texture_pool + i + 1,
+                sizeof(struct least_pooled_texture) *
+                (--texture_pool_count - i));
+            textures_reused++;
+            return texname;
+        }
+    }
+
+    /* The page size changed, the pooled textures will not be used anymore */
+    if (texture_pool_count)
+        texture_pool_drop();
+
+    /* Compute POT texture dimensions */
+    RPOW2(pow2_width, width);
+    RPOW2(pow2_height, height);
+
+    glGenTextures(1, &texname);
+    least_debug("Generated texture: %d\n", texname);
+    DEBUG_GL(glGenTextures);
+
+    /* Bind the texture object */
+    glBindTexture(GL_TEXTURE_2D, texname);
+    DEBUG_GL(glBindTexture);
+
+    /* Set the texture's stretching properties. With mipmaps the driver
+     * rebuilds the smaller levels whenever the page is uploaded, so pages
+     * shown smaller than they were rendered do not alias.
+     */
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+            use_mipmap ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    DEBUG_GL(glTexParameteri);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+            GL_LINEAR);
+    DEBUG_GL(glTexParameteri);
+    if (use_mipmap) {
+        glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP_SGIS, GL_TRUE);
+        DEBUG_GL(glTexParameteri);
+    }
+
+    /* Special treatment is only needed if the GPU does not support NPOT
+     * textures and the current pixmap is not of POT dimensions.
+     */
+    if (!power_of_two) {
+        pow2_width = width;
+        pow2_height = height;
+    }
+
+    /* Allocate undefined texture, stored in the format of the pixmaps so
+     * uploads need no conversion
+     */
+    glTexImage2D(GL_TEXTURE_2D, 0, format, pow2_width,
+             pow2_height, 0, format, GL_UNSIGNED_BYTE,
+             NULL);
+    DEBUG_GL(glTexImage2D);
+
+    textures_allocated++;
+
+    return texname;
+}
+
+/* Returns 'texture' from texture_get to the pool */
+static void texture_put(GLuint texture, int width, int height, int format)
+{
+    if (!texture)
+        return;
+
+    if (!texture_pool_size) {
+        glDeleteTextures(1, &texture);
+        return;
+    }
+
+    if (texture_pool_count == texture_pool_size)
+        texture_pool_drop();
+
+    texture_pool[texture_pool_count].name = texture;
+    texture_pool[texture_pool_count].w = width;
+    texture_pool[texture_pool_count].h = height;
+    texture_pool[texture_pool_count].format = format;
+    texture_pool_count++;
+    texture_pool_bytes += texture_size(width, height, format);
+
+    texture_pool_trim();
+}
+
+/* GPU memory held by the texture of 'pagenum' */
+static size_t page_texture_bytes(int pagenum)
+{
+    return texture_size(pages[pagenum].tw, pages[pagenum].th,
+        pages[pagenum].format);
+}
+
+/* Returns the texture of 'pagenum', if any, to the pool */
+static void page_texture_release(int pagenum)
+{
+    if (pages[pagenum].texture) {
+        texture_bytes -= page_texture_bytes(pagenum);
+        texture_pages--;
+    }
+
+    texture_put(pages[pagenum].texture, pages[pagenum].tw, pages[pagenum].th,
+        pages[pagenum].format);
+    pages[pagenum].texture = 0;
+    pages[pagenum].preview = 0;
+}
+
+/* Gives 'pagenum', which has no texture, 'texture' holding a 'format'
+ * pixmap of 'width' x 'height'
+ */
+static void page_texture_set(int pagenum, GLuint texture, int width,
+        int height, int format)
+{
+    pages[pagenum].texture = texture;
+    pages[pagenum].tw = width;
+    pages[pagenum].th = height;
+    pages[pagenum].format = format;
+    pages[pagenum].used = ++page_clock;
+    pages[pagenum].generation = render_generation;
+
+    texture_bytes += page_texture_bytes(pagenum);
+    texture_pages++;
+    texture_pool_trim();
+    if (texture_bytes > texture_bytes_peak)
+        texture_bytes_peak = texture_bytes;
+}
+
+/* Fills 'texture' with 'pixmap', which is an offset if a PBO is bound */
+static void texture_fill(GLuint texture, void *pixmap, int width, int height,
+        int format)
+{
+    glBindTexture(GL_TEXTURE_2D, texture);
+    DEBUG_GL(glBindTexture);
+
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+        format, GL_UNSIGNED_BYTE, pixmap);
+    DEBUG_GL(glTexSubImage2D);
+}
+
+/* GL format of the samples of 'pixmap' */
+static int pixmap_format(fz_context *context, fz_pixmap *pixmap)
+{
+    switch (fz_pixmap_components(context, pixmap)) {
+    case 1:
+        return GL_LUMINANCE;
+    case 3:
+        return GL_RGB;
+    default:
+        return GL_RGBA;
+    }
+}
+
+static int pixmap_to_texture(void *pixmap, int width, int height, int format, int type)
+{
+    GLuint texname;
+
+    (void)type;
+
+    texname = texture_get(width, height, format);
+    texture_fill(texname, pixmap, width, height, format);
+
+    return texname;
+}
+
+/* Upload ring of pixel buffer objects
+ *
+ * Uploading a page from client memory makes glTexImage2D copy the whole
+ * pixmap before it returns, which stalls the main thread for every completed
+ * page. Uploading from a PBO only queues a transfer the driver performs in
+ * the background.
+ *
+ * Page jobs get a mapped PBO handed to them while they are queued, so the
+ * render thread rasterizes straight into it and nothing is copied at all.
+ * Other pixmaps are copied into a free PBO first. Only if none is free, or
+ * GL_ARB_pixel_buffer_object is missing (--no-pbo), pages are uploaded
+ * synchronously.
+ */
+static int use_pbo = 1;
+static int pbo_count;
+static int pbo_next;    /* Ring position to look for a free buffer */
+static struct least_pbo *pbos;
+
+static PFNGLGENBUFFERSARBPROC gl_gen_buffers;
+static PFNGLBINDBUFFERARBPROC gl_bind_buffer;
+static PFNGLBUFFERDATAARBPROC gl_buffer_data;
+static PFNGLMAPBUFFERARBPROC gl_map_buffer;
+static PFNGLUNMAPBUFFERARBPROC gl_unmap_buffer;
+
+/* Loads the buffer object functions, which vertex buffers and PBOs share.
+ * Returns non-zero if they are missing.
+ */
+static int load_buffer_functions(void)
+{
+    gl_gen_buffers = (PFNGLGENBUFFERSARBPROC)
+        SDL_GL_GetProcAddress("glGenBuffersARB");
+    gl_bind_buffer = (PFNGLBINDBUFFERARBPROC)
+        SDL_GL_GetProcAddress("glBindBufferARB");
+    gl_buffer_data = (PFNGLBUFFERDATAARBPROC)
+        SDL_GL_GetProcAddress("glBufferDataARB");
+    gl_map_buffer = (PFNGLMAPBUFFERARBPROC)
+        SDL_GL_GetProcAddress("glMapBufferARB");
+    gl_unmap_buffer = (PFNGLUNMAPBUFFERARBPROC)
+        SDL_GL_GetProcAddress("glUnmapBufferARB");
+
+    return !gl_gen_buffers || !gl_bind_buffer || !gl_buffer_data ||
+        !gl_map_buffer || !gl_unmap_buffer;
+}
+
+/* Sets up the ring with one buffer per render thread plus one for copies.
+ * Must be called once a GL context exists.
+ */
+static void init_pbos(void)
+{
+    int i;
+
+    if (!use_pbo || !strstr((const char *)glGetString(GL_EXTENSIONS),
+            "GL_ARB_pixel_buffer_object")) {
+        least_info("Uploading textures synchronously.\n");
+        use_pbo = 0;
+        return;
+    }
+
+    if (load_buffer_functions()) {
+        least_warn("Cannot load PBO functions, "
+            "uploading textures synchronously.\n");
+        use_pbo = 0;
+        return;
+    }
+
+    pbo_count = thread_count + 1;
+    pbos = malloc(sizeof(struct least_pbo) * pbo_count);
+    if (!pbos) {
+        fprintf(stderr, "Cannot allocate PBO ring\n");
+        abort();
+    }
+
+    for (i = 0; i < pbo_count; i++) {
+        gl_gen_buffers(1, &pbos[i].name);
+        pbos[i].data = NULL;
+        pbos[i].size = 0;
+        pbos[i].in_use = 0;
+    }
+
+    least_info("Uploading textures through %d PBOs.\n", pbo_count);
+}
+
+/* Gives 'pbo' at least 'size' bytes of fresh storage and maps it.
+ *
+ * Orphaning the old storage lets the driver finish pending uploads from it
+ * in the background instead of making us wait for them.
+ * Must be called with 'pbo' bound and unmapped.
+ */
+static void pbo_map(struct least_pbo *pbo, size_t size)
+{
+    if (size < pbo->size)
+        size = pbo->size;
+
+    gl_buffer_data(GL_PIXEL_UNPACK_BUFFER_ARB, size, NULL, GL_STREAM_DRAW_ARB);
+    pbo->data = gl_map_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB);
+    pbo->size = pbo->data ? size : 0;
+}
+
+/* Takes a free buffer from the ring, mapped with at least 'size' bytes.
+ * Returns NULL if none is free.
+ */
+static struct least_pbo *pbo_get(size_t size)
+{
+    struct least_pbo *pbo;
+    int i;
+
+    for (i = 0; i < pbo_count; i++) {
+        pbo = pbos + (pbo_next + i) % pbo_count;
+        if (pbo->in_use)
+            continue;
+
+        if (!pbo->data || pbo->size < size) {
+            gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, pbo->name);
+            if (pbo->data)
+                gl_unmap_buffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+            pbo_map(pbo, size);
+            gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+
+            if (!pbo->data)
+                return NULL;
+        }
+
+        pbo_next = (pbo - pbos + 1) % pbo_count;
+        pbo->in_use = 1;
+        return pbo;
+    }
+
+    return NULL;
+}
+
+/* Uploads 'pixmap' of 'job' into a new texture.
+ *
+ * If the pixmap was rasterized into the job's PBO it is uploaded from
+ * there, otherwise it is copied into a free one first.
+ */
+static GLuint upload_pixmap(fz_context *context, struct least_job *job)
+{
+    struct least_pbo *pbo = job->pbo;
+    unsigned char *samples = fz_pixmap_samples(context, job->pixmap);
+    int width = fz_pixmap_width(context, job->pixmap);
+    int height = fz_pixmap_height(context, job->pixmap);
+    int format = pixmap_format(context, job->pixmap);
+    size_t size = (size_t)fz_pixmap_stride(context, job->pixmap) * height;
+    GLuint texture;
+    double t = least_time();
+
+    if (!pbo || pbo->data != samples) {
+        if (pbo)
+            pbo->in_use = 0;
+
+        job->pbo = pbo = use_pbo ? pbo_get(size) : NULL;
+        if (!pbo) {
+            texture = pixmap_to_texture(samples, width, height, format, 0);
+            samples_add(&upload_times, least_time() - t);
+            trace_end("upload", t, job->pagenum);
+            return texture;
+        }
+
+        memcpy(pbo->data, samples, size);
+    }
+
+    texture = texture_get(width, height, format);
+
+    /* With a PBO bound, the pixel pointer is an offset into the buffer */
+    gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, pbo->name);
+    gl_unmap_buffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+    pbo->data = NULL;
+
+    texture_fill(texture, NULL, width, height, format);
+
+    /* Map it again right away, so the next job can render into it */
+    pbo_map(pbo, size);
+    gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+
+    samples_add(&upload_times, least_time() - t);
+    trace_end("upload", t, job->pagenum);
+
+    return texture;
+}
+
+/* Quad batches
+ *
+ * Everything on screen is a textured quad. Instead of drawing quads one by one
+ * in immediate mode, a frame collects them with batch_quad. batch_draw then
+ * sorts them by texture, streams all vertices into one vertex buffer and
+ * draws the quads of every texture with a single glDrawArrays. Thumbnails
+ * share a few atlases, so an overview full of them takes a handful of calls.
+ *
+ * Without GL_ARB_vertex_buffer_object the vertices are drawn from client
+ * memory instead.
+ */
+struct least_quad {
+    GLuint texture;
+    int index;      /* Order of submission, keeps the sort stable */
+    float x0, y0, x1, y1;
+    float s0, t0, s1, t1;
+};
+
+struct least_vertex {
+    float s, t;
+    float x, y;
+};
+
+static struct least_quad *batch;
+static int batch_count, batch_size;
+static struct least_vertex *batch_vertices;
+static int batch_vertices_size;
+static GLuint batch_buffer;     /* Vertex buffer, 0 to use client memory */
+
+/* Statistics */
+static int batch_calls;         /* glDrawArrays calls of the last batch */
+
+/* Sets up the vertex buffer, must be called once a GL context exists */
+static void init_batch(void)
+{
+    if (strstr((const char *)glGetString(GL_EXTENSIONS),
+            "GL_ARB_vertex_buffer_object") && !load_buffer_functions()) {
+        gl_gen_buffers(1, &batch_buffer);
+        least_info("Drawing quads from a vertex buffer.\n");
+    } else {
+        least_info("Drawing quads from client memory.\n");
+    }
+}
+
+/* Adds a quad showing ('s0', 't0') - ('s1', 't1') of 'texture' at
+ * ('x0', 'y0') - ('x1', 'y1') to the batch
+ */
+static void batch_quad(GLuint texture, float x0, float y0, float x1,
+        float y1, float s0, float t0, float s1, float t1)
+{
+    struct least_quad *q;
+
+    if (batch_count == batch_size) {
+        batch_size = batch_size ? batch_size * 2 : 64;
+        batch = realloc(batch, sizeof(struct least_quad) * batch_size);
+        if (!batch) {
+            fprintf(stderr, "Out of memory while batching quads\n");
+            abort();
+        }
+    }
+
+    q = batch + batch_count;
+    q->texture = texture;
+    q->index = batch_count++;
+    q->x0 = x0;
+    q->y0 = y0;
+    q->x1 = x1;
+    q->y1 = y1;
+    q->s0 = s0;
+    q->t0 = t0;
+    q->s1 = s1;
+    q->t1 = t1;
+}
+
+static int compare_quad(const void *a, const void *b)
+{
+    const struct least_quad *x = a, *y = b;
+
+    if (x->texture != y->texture)
+        return x->texture < y->texture ? -1 : 1;
+
+    return x->index - y->index;
+}
+
+/* Writes the vertices of 'q' to 'v' */
+static void quad_vertices(struct least_vertex *v, struct least_quad *q)
+{
+    v[0].s = q->s0;
+    v[0].t = q->t0;
+    v[0].x = q->x0;
+    v[0].y = q->y0;
+
+    v[1].s = q->s1;
+    v[1].t = q->t0;
+    v[1].x = q->x1;
+    v[1].y = q->y0;
+
+    v[2].s = q->s1;
+    v[2].t = q->t1;
+    v[2].x = q->x1;
+    v[2].y = q->y1;
+
+    v[3].s = q->s0;
+    v[3].t = q->t1;
+    v[3].x = q->x0;
+    v[3].y = q->y1;
+}
+
+/* Draws and empties the batch */
+static void batch_draw(void)
+{
+    char *base;
+    int i, run;
+
+    batch_calls = 0;
+    if (!batch_count)
+        return;
+
+    qsort(batch, batch_count, sizeof(struct least_quad), compare_quad);
+
+    if (batch_vertices_size < batch_count * 4) {
+        batch_vertices_size = batch_size * 4;
+        batch_vertices = realloc(batch_vertices,
+            sizeof(struct least_vertex) * batch_vertices_size);
+        if (!batch_vertices) {
+            fprintf(stderr, "Out of memory while batching quads\n");
+            abort();
+        }
+    }
+
+    for (i = 0; i < batch_count; i++)
+        quad_vertices(batch_vertices + i * 4, batch + i);
+
+    /* With a vertex buffer bound, the pointers are offsets into it */
+    base = (char *)batch_vertices;
+    if (batch_buffer) {
+        gl_bind_buffer(GL_ARRAY_BUFFER_ARB, batch_buffer);
+        gl_buffer_data(GL_ARRAY_BUFFER_ARB,
+            sizeof(struct least_vertex) * batch_count * 4, batch_vertices,
+            GL_STREAM_DRAW_ARB);
+        base = NULL;
+    }
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(struct least_vertex), base);
+    glVertexPointer(2, GL_FLOAT, sizeof(struct least_vertex),
+        base + sizeof(float) * 2);
+
+    for (i = 0; i < batch_count; i = run) {
+        for (run = i + 1; run < batch_count &&
+                batch[run].texture == batch[i].texture; run++)
+            ;
+
+        glBindTexture(GL_TEXTURE_2D, batch[i].texture);
+        glDrawArrays(GL_QUADS, i * 4, (run - i) * 4);
+        batch_calls++;
+    }
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    if (batch_buffer)
+        gl_bind_buffer(GL_ARRAY_BUFFER_ARB, 0);
+
+    batch_count = 0;
+}
+
+/* Allocates the thumbnail atlases, must be called once a GL context exists */
+static void init_atlases(void)
+{
+    GLint max_size;
+    int i;
+
+    /* Atlases are POT, so they work on any machine */
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    atlas_size = max_size < 2048 ? max_size : 2048;
+    atlas_columns = atlas_size / THUMB_W;
+    atlas_cells = atlas_columns * (atlas_size / THUMB_H);
+    thumb_slots = atlas_cells * ATLAS_COUNT;
+
+    thumbs = malloc(sizeof(struct least_thumb_slot) * thumb_slots);
+    if (!thumbs) {
+        fprintf(stderr, "Cannot allocate thumbnail slots\n");
+        abort();
+    }
+
+    for (i = 0; i < thumb_slots; i++) {
+        thumbs[i].pagenum = -1;
+        thumbs[i].used = 0;
+    }
+
+    glGenTextures(ATLAS_COUNT, atlas_textures);
+    for (i = 0; i < ATLAS_COUNT; i++) {
+        glBindTexture(GL_TEXTURE_2D, atlas_textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, atlas_size, atlas_size, 0,
+            GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        DEBUG_GL(glTexImage2D);
+    }
+
+    least_info("Thumbnails: %d atlases of %dx%d, %d slots\n", ATLAS_COUNT,
+        atlas_size, atlas_size, thumb_slots);
+}
+
+/* Computes the atlas texture coordinates of thumbnail slot 'index' */
+static void thumb_coords(int index, float *s0, float *t0, float *s1,
+        float *t1)
+{
+    int cell = index % atlas_cells;
+
+    *s0 = (float)(cell % atlas_columns) * THUMB_W / atlas_size;
+    *t0 = (float)(cell / atlas_columns) * THUMB_H / atlas_size;
+    *s1 = *s0 + (float)thumbs[index].w / atlas_size;
+    *t1 = *t0 + (float)thumbs[index].h / atlas_size;
+}
+
+/* Stores the thumbnail of 'pagenum' in its slot, or takes the least
+ * recently drawn slot if it has none yet.
+ */
+static void thumb_store(int pagenum, void *pixmap, int width, int height,
+        int format)
+{
+    struct least_thumb_slot *slot;
+    int i, cell;
+
+    if (pages[pagenum].thumb) {
+        slot = thumbs + pages[pagenum].thumb - 1;
+    } else {
+        slot = thumbs;
+        for (i = 1; i < thumb_slots; i++)
+            if (thumbs[i].used < slot->used)
+                slot = thumbs + i;
+
+        if (slot->pagenum >= 0) {
+            least_debug("thumbs: Evicting page %d\n", slot->pagenum);
+            pages[slot->pagenum].thumb = 0;
+        }
+    }
+
+    i = slot - thumbs;
+    slot->pagenum = pagenum;
+    slot->w = width < THUMB_W ? width : THUMB_W;
+    slot->h = height < THUMB_H ? height : THUMB_H;
+    slot->used = ++thumb_clock;
+    pages[pagenum].thumb = i + 1;
+
+    cell = i % atlas_cells;
+    glBindTexture(GL_TEXTURE_2D, atlas_textures[i / atlas_cells]);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, (cell % atlas_columns) * THUMB_W,
+        (cell / atlas_columns) * THUMB_H, slot->w, slot->h,
+        format, GL_UNSIGNED_BYTE, pixmap);
+    DEBUG_GL(glTexSubImage2D);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+/* Statistics
+ *
+ * Counters for the render pipeline are kept all the time, they are plain
+ * variables updated where things happen. stats_update formats them for the
+ * overlay, toggled with 's', every STATS_INTERVAL and for the dump on
+ * SIGUSR1:
+ *
+ *   kill -USR1 $(pidof least)
+ *
+ * Timings are summarised over the last STATS_RECENT samples only, so the
+ * cost of an update does not grow with the time least runs.
+ */
+#define STATS_INTERVAL 250  /* Overlay refresh, in ms */
+#define STATS_RECENT 256    /* Samples timing percentiles are taken of */
+#define FONT_SCALE 2        /* Screen pixels per font pixel */
+
+/* Totals of the stages of delivered renders, in seconds */
+static struct least_render_times stage_totals;
+static int stage_count;
+
+/* Pages coming into view with and without a full resolution texture */
+static int view_hits, view_misses;
+static int view_first, view_last = -1;
+
+static int stats_overlay;   /* Set while the overlay is shown */
+static SDL_TimerID stats_timer;
+static GLuint font_texture;
+
+static char stats_text[2048];
+static int stats_len;
+
+/* 5 x 7 glyphs of ASCII 32 - 95, rows top to bottom, bit 4 is the left
+ * column. Lower case is shown as upper case.
+ */
+static const unsigned char font_glyphs[64][7] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* space */
+    {0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04}, /* ! */
+    {0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00}, /* " */
+    {0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a}, /* # */
+    {0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04}, /* $ */
+    {0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03}, /* % */
+    {0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d}, /* & */
+    {0x04, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00}, /* ' */
+    {0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02}, /* ( */
+    {0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08}, /* ) */
+    {0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00}, /* * */
+    {0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00}, /* + */
+    {0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08}, /* , */
+    {0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00}, /* - */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c}, /* . */
+    {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}, /* / */
+    {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e}, /* 0 */
+    {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e}, /* 1 */
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f}, /* 2 */
+    {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e}, /* 3 */
+    {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02}, /* 4 */
+    {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e}, /* 5 */
+    {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e}, /* 6 */
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}, /* 7 */
+    {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e}, /* 8 */
+    {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c}, /* 9 */
+    {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00}, /* : */
+    {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08}, /* ; */
+    {0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02}, /* < */
+    {0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00}, /* = */
+    {0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08}, /* > */
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04}, /* ? */
+    {0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e}, /* @ */
+    {0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}, /* A */
+    {0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e}, /* B */
+    {0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e}, /* C */
+    {0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c}, /* D */
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f}, /* E */
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10}, /* F */
+    {0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f}, /* G */
+    {0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}, /* H */
+    {0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e}, /* I */
+    {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c}, /* J */
+    {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, /* K */
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f}, /* L */
+    {0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11}, /* M */
+    {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11}, /* N */
+    {0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, /* O */
+    {0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10}, /* P */
+    {0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d}, /* Q */
+    {0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11}, /* R */
+    {0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e}, /* S */
+    {0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04}, /* T */
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, /* U */
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04}, /* V */
+    {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a}, /* W */
+    {0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11}, /* X */
+    {0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04}, /* Y */
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f}, /* Z */
+    {0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e}, /* [ */
+    {0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00}, /* backslash */
+    {0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e}, /* ] */
+    {0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00}, /* ^ */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f}, /* _ */
+};
+
+static void stats_add_times(struct least_render_times *t)
+{
+    stage_totals.wait += t->wait;
+    stage_totals.load += t->load;
+    stage_totals.list += t->list;
+    stage_totals.raster += t->raster;
+    stage_count++;
+}
+
+/* Counts the pages that came into view since the last call */
+static void stats_view(int first, int last)
+{
+    int i;
+
+    for (i = first; i <= last; i++) {
+        if (i >= view_first && i <= view_last)
+            continue;
+
+        if (pages[i].texture && !pages[i].preview)
+            view_hits++;
+        else
+            view_misses++;
+    }
+
+    view_first = first;
+    view_last = last;
+}
+
+/* Returns percentile 'p' of the last STATS_RECENT samples of 's'. Unlike
+ * samples_percentile it leaves 's' in order.
+ */
+static double samples_recent(struct least_samples *s, double p)
+{
+    static double v[STATS_RECENT];
+    struct least_samples recent;
+    int n = s->count < STATS_RECENT ? s->count : STATS_RECENT;
+
+    if (!n)
+        return 0;
+
+    memcpy(v, s->v + s->count - n, sizeof(double) * n);
+    recent.v = v;
+    recent.count = n;
+    recent.size = STATS_RECENT;
+
+    return samples_percentile(&recent, p);
+}
+
+static void stats_printf(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (stats_len >= (int)sizeof(stats_text) - 1)
+        return;
+
+    va_start(ap, fmt);
+    stats_len += vsnprintf(stats_text + stats_len,
+        sizeof(stats_text) - stats_len, fmt, ap);
+    va_end(ap);
+
+    if (stats_len > (int)sizeof(stats_text) - 1)
+        stats_len = sizeof(stats_text) - 1;
+}
+
+/* Formats the counters into stats_text */
+static void stats_update(void)
+{
+    int queued, idle, list_hits, list_misses, disk_hits = 0, disk_misses = 0;
+    int stale = 0;
+    double n = stage_count ? stage_count * 1e-3 : 1;
+    unsigned int i;
+
+    SDL_mutexP(queue.lock);
+    queued = queue.count;
+    idle = idle_thread_count;
+    SDL_mutexV(queue.lock);
+
+    SDL_mutexP(list_cache_lock);
+    list_hits = list_cache_hits;
+    list_misses = list_cache_misses;
+    SDL_mutexV(list_cache_lock);
+
+    /* The lock only exists while the disk cache is in use */
+    if (disk_cache_dir) {
+        SDL_mutexP(disk_cache_lock);
+        disk_hits = disk_cache_hits;
+        disk_misses = disk_cache_misses;
+        SDL_mutexV(disk_cache_lock);
+    }
+
+    for (i = 0; i < pagec; i++)
+        if (pages[i].texture && pages[i].generation != render_generation)
+            stale++;
+
+    stats_len = 0;
+    stats_printf("jobs     %d page, %d preview, %d thumb, %d text\n",
+        renders_scheduled[LEAST_JOB_PAGE],
+        renders_scheduled[LEAST_JOB_PREVIEW],
+        renders_scheduled[LEAST_JOB_THUMB],
+        renders_scheduled[LEAST_JOB_TEXT]);
+    stats_printf("renders  %d completed, %d cancelled, %d discarded, "
+        "%d failed\n", renders_completed, renders_cancelled,
+        renders_discarded, renders_failed);
+    stats_printf("queue    %d queued, %d of %d threads idle\n",
+        queued, idle, thread_count);
+    stats_printf("stages   wait %.1f, load %.1f, list %.1f, raster %.1f, "
+        "upload %.1f ms avg\n", stage_totals.wait / n,
+        stage_totals.load / n, stage_totals.list / n,
+        stage_totals.raster / n,
+        samples_recent(&upload_times, 50) * 1e3);
+    stats_printf("textures %.1f of %.1f MB, %d pages, %d stale\n",
+        texture_bytes / (1024. * 1024.), texture_budget / (1024. * 1024.),
+        texture_pages, stale);
+    stats_printf("view     %d hits, %d misses\n", view_hits, view_misses);
+    stats_printf("lists    %d hits, %d misses\n", list_hits, list_misses);
+    if (disk_cache_dir)
+        stats_printf("disk     %d hits, %d misses\n", disk_hits,
+            disk_misses);
+    stats_printf("text     %u of %u pages, %.1f MB\n", text_indexed, pagec,
+        text_bytes / (1024. * 1024.));
+    stats_printf("frames   %.1f ms p50, %.1f ms p99, %d dropped\n",
+        samples_recent(&frame_times, 50) * 1e3,
+        samples_recent(&frame_times, 99) * 1e3, frames_dropped);
+}
+
+/* Runs in SDL's timer thread for as long as least runs */
+static Uint32 stats_timer_fired(Uint32 interval, void *param)
+{
+    SDL_Event event;
+
+    (void)param;
+
+    if (stats_overlay) {
+        event.type = LEAST_STATS_TICK;
+        event.user.code = 0;
+        SDL_PushEvent(&event);
+    }
+
+    return interval;
+}
+
+static void toggle_stats(void)
+{
+    stats_overlay = !stats_overlay;
+    if (stats_overlay)
+        stats_update();
+    redraw = 1;
+
+    if (!stats_timer)
+        stats_timer = SDL_AddTimer(STATS_INTERVAL, stats_timer_fired, NULL);
+}
+
+/* Prints the counters, on SIGUSR1 */
+static void stats_dump(void)
+{
+    stats_update();
+    printf("least statistics:\n%s", stats_text);
+    fflush(stdout);
+}
+
+/* Takes SIGUSR1, which every other thread blocks. The main thread may be
+ * asleep in SDL_WaitEvent, an event wakes it up.
+ */
+static int stats_signal_thread(void *unused)
+{
+    SDL_Event event;
+    sigset_t set;
+    int sig;
+
+    (void)unused;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    event.type = LEAST_STATS_DUMP;
+    event.user.code = 0;
+
+    while (!sigwait(&set, &sig))
+        SDL_PushEvent(&event);
+
+    return 0;
+}
+
+/* Blocks SIGUSR1 for stats_signal_thread. Must be called before any other
+ * thread is started, they inherit the signal mask.
+ */
+static void block_stats_signal(void)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static void init_stats_signal(void)
+{
+    if (!SDL_CreateThread(stats_signal_thread, NULL))
+        fprintf(stderr, "Cannot start signal thread, SIGUSR1 is ignored\n");
+}
+
+/* Uploads font_glyphs into a 128 x 32 alpha texture of 8 x 8 cells, must be
+ * called once a GL context exists
+ */
+static void init_font(void)
+{
+    unsigned char pixels[32][128];
+    int c, x, y;
+
+    memset(pixels, 0, sizeof(pixels));
+    for (c = 0; c < 64; c++)
+        for (y = 0; y < 7; y++)
+            for (x = 0; x < 5; x++)
+                if (font_glyphs[c][y] & 0x10 >> x)
+                    pixels[c / 16 * 8 + y][c % 16 * 8 + x] = 255;
+
+    glGenTextures(1, &font_texture);
+    glBindTexture(GL_TEXTURE_2D, font_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, 128, 32, 0, GL_ALPHA,
+        GL_UNSIGNED_BYTE, pixels);
+    DEBUG_GL(glTexImage2D);
+}
+
+/* Draws stats_text on a translucent panel in the top left corner */
+static void draw_stats(void)
+{
+    int c, col = 0, row = 0, cols = 0;
+    float x, y, s, t;
+    const char *p;
+
+    if (!stats_overlay)
+        return;
+
+    for (p = stats_text; *p; p++) {
+        if (*p == '\n') {
+            row++;
+            col = 0;
+        } else if (++col > cols) {
+            cols = col;
+        }
+    }
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    glDisable(GL_TEXTURE_2D);
+    glColor4f(0.0f, 0.0f, 0.0f, 0.6f);
+    batch_quad(0, 8, 8, 8 + (cols * 6 + 8) * FONT_SCALE,
+        8 + (row * 9 + 8) * FONT_SCALE, 0, 0, 0, 0);
+    batch_draw();
+
+    glEnable(GL_TEXTURE_2D);
+    glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+    col = row = 0;
+    for (p = stats_text; *p; p++) {
+        if (*p == '\n') {
+            row++;
+            col = 0;
+            continue;
+        }
+
+        c = toupper((unsigned char)*p) - 32;
+        if (c > 0 && c < 64) {
+            x = 8 + (col * 6 + 4) * FONT_SCALE;
+            y = 8 + (row * 9 + 4) * FONT_SCALE;
+            s = c % 16 * 8 / 128.f;
+            t = c / 16 * 8 / 32.f;
+            batch_quad(font_texture, x, y, x + 5 * FONT_SCALE,
+                y + 7 * FONT_SCALE, s, t, s + 5 / 128.f, t + 7 / 32.f);
+        }
+        col++;
+    }
+    batch_draw();
+
+    glDisable(GL_BLEND);
+}
+
+static void quit_tutorial(int code)
+{
+    unsigned int i;
+
+    /* Print what was logged before the statistics */
+    log_stop();
+
+    for (i = 0; i < pagec; i++)
         glDeleteTextures(1, &pages[i].texture);
 
+    if (atlas_size)
+        glDeleteTextures(ATLAS_COUNT, atlas_textures);
+
+    printf("Renders: %d completed, %d cancelled, %d discarded, %d failed\n",
+        renders_completed, renders_cancelled, renders_discarded,
+        renders_failed);
+    printf("Pages coming into view: %d rendered, %d not yet\n",
+        view_hits, view_misses);
+    printf("Textures: %d allocated, %d reused from the pool\n",
+        textures_allocated, textures_reused);
+    printf("Page textures: %.1f MB peak of %.1f MB budget\n",
+        texture_bytes_peak / (1024. * 1024.),
+        texture_budget / (1024. * 1024.));
+    /* Render threads are still running */
+    if (disk_cache_dir) {
+        SDL_mutexP(disk_cache_lock);
+        printf("Disk cache: %d hits, %d misses\n",
+            disk_cache_hits, disk_cache_misses);
+        SDL_mutexV(disk_cache_lock);
+    }
+    printf("Prefetch: %d deadlines met, %d missed by %.0f ms p50, "
+        "%.0f ms max\n", deadlines_met, deadlines_missed,
+        samples_percentile(&deadline_lateness, 50) * 1e3,
+        samples_percentile(&deadline_lateness, 100) * 1e3);
+    printf("Busy pages shown in %d of %d frames while scrolling\n",
+        busy_frames, travel_frames);
+    printf("Text index: %u of %u pages, %.1f MB\n", text_indexed, pagec,
+        text_bytes / (1024. * 1024.));
+    printf("Links: %d followed, %d of them to a rendered page\n",
+        link_clicks, link_clicks_ready);
+
+    /* Compare with --no-pbo to see the upload hitches */
+    printf("Main thread timings (ms), %d frames, %d uploads %s:\n",
+        frame_times.count, upload_times.count,
+        use_pbo ? "through PBOs" : "synchronous");
+    printf("  %-8s %9s %9s %9s %9s\n", "", "p50", "p90", "p99", "max");
+    print_samples("frame", &frame_times);
+    print_samples("upload", &upload_times);
+    print_samples("interval", &frame_intervals);
+    printf("Dropped frames: %d while scrolling, vsync %s, %.0f Hz\n",
+        frames_dropped, vsync ? "on" : "off", 1 / frame_interval);
+
+    trace_write();
+
     exit(code);
 }
 
+/* Switches between the page view and the overview, keeping the scroll
+ * position of the page view.
+ */
+static void toggle_overview(void)
+{
+    if (!pagec)
+        return;
+
+    if (!overview) {
+        overview = 1;
+        page_scroll = scroll;
+
+        /* Put the row of the focus page in the middle of the window */
+        scroll = h / 2 - (page_focus / overview_columns() + 0.5f) * CELL_H;
+    } else {
+        overview = 0;
+        scroll = page_scroll;
+    }
+
+    redraw = 1;
+}
+
+/* Leaves the overview at the top of 'pagenum' */
+static void jump_to_page(int pagenum)
+{
+    overview = 0;
+    scroll = -page_top(pagenum);
+    redraw = 1;
+}
+
+/* Zoom and rescaling
+ *
+ * Pages are rendered lw pixels wide. When the window size or the zoom
+ * changes, the pages on screen are stretched from their textures right away,
+ * see detect_mipmap. Once neither changed for RESCALE_DELAY, a new render
+ * generation starts at the new width. Every page keeps its old texture until
+ * the new render replaces it, and visible pages are rendered first.
+ */
+#define RESCALE_DELAY 0.3       /* Seconds */
+#define RENDER_WIDTH_MAX 4096   /* Zooming further stretches the textures */
+#define ZOOM_MIN 0.25f
+#define ZOOM_MAX 4.0f
+#define ZOOM_STEP 1.25f
+
+static double rescale_time;     /* Last change of window size or zoom */
+static SDL_TimerID rescale_timer;
+
+/* Width to render pages at for the current window size and zoom */
+static float render_width(void)
+{
+    static GLint max_width;
+
+    if (!max_width) {
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_width);
+        if (max_width > RENDER_WIDTH_MAX)
+            max_width = RENDER_WIDTH_MAX;
+    }
+
+    return w * zoom < max_width ? w * zoom : max_width;
+}
+
+/* Returns 1 if the texture of 'pagenum' is of an older render generation */
+static int page_stale(int pagenum)
+{
+    return pages[pagenum].generation != render_generation;
+}
+
+/* Starts a new render generation at render_width. Queued jobs are dropped
+ * and running ones cancelled, so no render at the old width completes
+ * anymore. update_cache schedules new ones, see page_stale.
+ */
+static void rescale(void)
+{
+    unsigned int i;
+    double position;
+
+    /* Keep the queued LEAST_JOB_OPEN, the first page is not scheduled yet */
+    if (!pagec) {
+        lw = render_width();
+        lh = h;
+        redraw = 1;
+        return;
+    }
+
+    for (i = 0; i < pagec; i++) {
+        pages[i].rendering = 0;
+        pages[i].previewing = 0;
+        pages[i].thumbing = 0;
+    }
+
+    SDL_mutexP(queue.lock);
+    render_generation++;
+    queue_clear();
+    SDL_mutexV(queue.lock);
+
+    /* The layout scales with the render width, stay on the same spot */
+    least_debug("rescale: Render width %.0f -> %.0f\n", lw, render_width());
+    position = scroll_to_position(*page_view_scroll());
+    lw = render_width();
+    lh = h;
+    *page_view_scroll() = position_to_scroll(position);
+
+    redraw = 1;
+}
+
+/* Runs in SDL's timer thread */
+static Uint32 rescale_timer_fired(Uint32 interval, void *param)
+{
+    SDL_Event event;
+
+    (void)interval;
+    (void)param;
+
+    event.type = LEAST_RESCALE;
+    event.user.code = 0;
+    SDL_PushEvent(&event);
+
+    return 0;
+}
+
+static void rescale_arm(double delay)
+{
+    rescale_timer = SDL_AddTimer(delay * 1000 + 1, rescale_timer_fired, NULL);
+}
+
+/* Notes a change of window size or zoom, rescale follows once they settle */
+static void rescale_request(void)
+{
+    rescale_time = least_time();
+    redraw = 1;
+
+    if (!rescale_timer)
+        rescale_arm(RESCALE_DELAY);
+}
+
+/* Handles LEAST_RESCALE, waiting longer if there were changes since */
+static void rescale_settle(void)
+{
+    double idle = least_time() - rescale_time;
+
+    rescale_timer = NULL;
+    if (idle < RESCALE_DELAY)
+        rescale_arm(RESCALE_DELAY - idle);
+    else if (render_width() != lw)
+        rescale();
+}
+
+/* Keeps zoomed in pages covering the window */
+static void pan_by(float dx)
+{
+    float limit = (w * zoom - w) / 2;
+
+    pan += dx;
+    if (limit < 0)
+        limit = 0;
+    if (pan > limit)
+        pan = limit;
+    if (pan < -limit)
+        pan = -limit;
+
+    redraw = 1;
+}
+
+/* Zooms the page view by 'factor', keeping window row 'y' in place */
+static void zoom_by(float factor, int y)
+{
+    float units, z = zoom * factor;
+
+    if (overview)
+        return;
+
+    if (z < ZOOM_MIN)
+        z = ZOOM_MIN;
+    if (z > ZOOM_MAX)
+        z = ZOOM_MAX;
+
+    units = -scroll + y / view_scale();
+    pan *= z / zoom;
+    zoom = z;
+    scroll = -units + y / view_scale();
+    pan_by(0);
+
+    rescale_request();
+}
+
+/* Text search
+ *
+ * '/' starts typing a query, which is searched for as it is typed. A longer
+ * query only rechecks the matches of the shorter one, anything else rescans
+ * the text index. Pages indexed later are searched as they arrive, so matches
+ * stream in while indexing runs. Enter stops typing and shows the first match
+ * from the focus page on, 'n' and 'N' step through the matches and Escape
+ * ends the search. The query and the match count show in the window title.
+ */
+#define SEARCH_MAX 128
+
+struct least_match {
+    int pagenum;
+    int first;      /* Index of the first character in the page text */
+};
+
+static int searching;           /* Set while the query is being typed */
+static unsigned short search_query[SEARCH_MAX]; /* Folded, see text_fold */
+static int search_len;
+static double search_time;      /* Duration of the last search, seconds */
+
+/* Matches of the query, ordered by page and position */
+static struct least_match *matches;
+static int match_count, match_size;
+static int match_current = -1;  /* Match shown last, -1 for none */
+
+/* Returns the index of the first match on or after 'pagenum' */
+static int match_lower(int pagenum)
+{
+    int lo = 0, hi = match_count, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (matches[mid].pagenum < pagenum)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Pages are searched whole and usually in order, so matches are inserted
+ * at or near the end.
+ */
+static void match_add(int pagenum, int first)
+{
+    int i;
+
+    if (match_count == match_size) {
+        match_size = match_size ? match_size * 2 : 64;
+        matches = realloc(matches, sizeof(struct least_match) * match_size);
+        if (!matches) {
+            fprintf(stderr, "Out of memory while searching\n");
+            abort();
+        }
+    }
+
+    for (i = match_count; i > 0 && matches[i - 1].pagenum > pagenum; i--)
+        ;
+
+    memmove(matches + i + 1, matches + i,
+        sizeof(struct least_match) * (match_count - i));
+    matches[i].pagenum = pagenum;
+    matches[i].first = first;
+    match_count++;
+
+    if (match_current >= i)
+        match_current++;
+}
+
+static void search_page(int pagenum)
+{
+    struct least_page_text *t = pages[pagenum].text;
+    int i, k;
+
+    if (!t || !search_len)
+        return;
+
+    for (i = 0; i + search_len <= t->len; i++) {
+        if (t->text[i] != search_query[0])
+            continue;
+
+        for (k = 1; k < search_len && t->text[i + k] == search_query[k]; k++)
+            ;
+
+        if (k == search_len)
+            match_add(pagenum, i);
+    }
+}
+
+/* Writes 'c' as UTF-8 to 's', returns the number of bytes */
+static int utf8_put(char *s, unsigned short c)
+{
+    if (c < 0x80) {
+        s[0] = c;
+        return 1;
+    }
+
+    if (c < 0x800) {
+        s[0] = 0xc0 | c >> 6;
+        s[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+
+    s[0] = 0xe0 | c >> 12;
+    s[1] = 0x80 | (c >> 6 & 0x3f);
+    s[2] = 0x80 | (c & 0x3f);
+    return 3;
+}
+
+/* Shows the state of the search in the window title */
+static void search_status(void)
+{
+    char title[SEARCH_MAX * 3 + 128];
+    int i, n;
+
+    if (!searching && !search_len) {
+        SDL_WM_SetCaption("least", "least");
+        return;
+    }
+
+    n = sprintf(title, "least - /");
+    for (i = 0; i < search_len; i++)
+        n += utf8_put(title + n, search_query[i]);
+    if (searching)
+        title[n++] = '_';
+
+    if (match_current >= 0)
+        n += sprintf(title + n, " - match %d of %d", match_current + 1,
+            match_count);
+    else
+        n += sprintf(title + n, " - %d matches", match_count);
+    n += sprintf(title + n, " (%.1f ms)", search_time * 1e3);
+
+    if (text_indexed < pagec)
+        sprintf(title + n, ", %u%% indexed", text_indexed * 100 / pagec);
+
+    SDL_WM_SetCaption(title, "least");
+}
+
+/* Searches for the query after it changed. 'extended' is set if a character
+ * was appended.
+ */
+static void search_update(int extended)
+{
+    struct least_page_text *t;
+    double t0 = least_time();
+    unsigned int p;
+    int i, k, n;
+
+    if (extended && search_len > 1) {
+        /* Matches of the query are among those of its prefix */
+        for (i = n = 0; i < match_count; i++) {
+            t = pages[matches[i].pagenum].text;
+            k = matches[i].first + search_len - 1;
+            if (k < t->len && t->text[k] == search_query[search_len - 1])
+                matches[n++] = matches[i];
+        }
+        match_count = n;
+    } else {
+        match_count = 0;
+        for (p = 0; p < pagec; p++)
+            search_page(p);
+    }
+
+    match_current = -1;
+    search_time = least_time() - t0;
+    redraw = 1;
+    search_status();
+}
+
+static void search_end(void)
+{
+    searching = 0;
+    search_len = 0;
+    match_count = 0;
+    match_current = -1;
+    redraw = 1;
+    search_status();
+}
+
+/* Returns the line of 't' holding character 'k' */
+static int text_line(struct least_page_text *t, int k)
+{
+    int lo = 0, hi = t->line_count - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (t->lines[mid].first <= k)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+/* Leaves the overview with the line of match 'index' a third down the
+ * window
+ */
+static void search_show(int index)
+{
+    struct least_match *m = matches + index;
+    struct least_page_text *t = pages[m->pagenum].text;
+    float y = t->lines[text_line(t, m->first)].y0 * lw / t->width;
+
+    match_current = index;
+    overview = 0;
+    scroll = -(page_top(m->pagenum) + y) + h / 3 / view_scale();
+    redraw = 1;
+    search_status();
+}
+
+/* Shows the next match in direction 'dir', starting from the focus page if
+ * no match was shown yet
+ */
+static void search_next(int dir)
+{
+    int i;
+
+    if (!match_count)
+        return;
+
+    if (match_current >= 0)
+        i = match_current + dir;
+    else if (dir > 0)
+        i = match_lower(page_focus);
+    else
+        i = match_lower(page_focus + 1) - 1;
+
+    search_show((i + match_count) % match_count);
+}
+
+/* Handles a key while the query is typed */
+static void search_key(SDL_keysym *keysym)
+{
+    switch (keysym->sym) {
+    case SDLK_ESCAPE:
+        search_end();
+        break;
+
+    case SDLK_RETURN:
+        searching = 0;
+        if (match_count)
+            search_next(1);
+        else
+            search_status();
+        break;
+
+    case SDLK_BACKSPACE:
+        if (search_len) {
+            search_len--;
+            search_update(0);
+        }
+        break;
+
+    default:
+        if (keysym->unicode >= ' ' && keysym->unicode != 127 &&
+                search_len < SEARCH_MAX) {
+            search_query[search_len++] = text_fold(keysym->unicode);
+            search_update(1);
+        }
+        break;
+    }
+}
+
+/* Adds the highlight of the match at character 'first' of 't' to the batch,
+ * a quad for every line it covers. The page is at ('vx', 'vy'), 'scale' maps
+ * page space to the window.
+ */
+static void match_quads(struct least_page_text *t, int first, float vx,
+        float vy, float scale)
+{
+    struct least_text_line *l;
+    int k, stop, line = text_line(t, first);
+    float xs = scale / TEXT_UNITS;
+
+    for (k = first; k < first + search_len; k = stop) {
+        l = t->lines + line++;
+        stop = line < t->line_count ? t->lines[line].first : t->len;
+        if (stop > first + search_len)
+            stop = first + search_len;
+
+        batch_quad(0, vx + t->x[k * 2] * xs, vy + l->y0 * scale,
+            vx + t->x[stop * 2 - 1] * xs, vy + l->y1 * scale, 0, 0, 0, 0);
+    }
+}
+
+/* Highlights the matches on pages [first, last] like a marker, by
+ * multiplying the page with the highlight colour. The shown match stands
+ * out.
+ */
+static void draw_matches(int first, int last, float vscale)
+{
+    struct least_page_text *t;
+    int i, m, current = 0;
+    float scale;
+
+    if (!match_count)
+        return;
+
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_DST_COLOR, GL_ZERO);
+
+    for (i = first; i <= last; i++) {
+        t = pages[i].text;
+        if (!t || !t->width)
+            continue;
+
+        scale = lw * vscale / t->width;
+        for (m = match_lower(i); m < match_count &&
+                matches[m].pagenum == i; m++) {
+            if (m == match_current)
+                current = 1;
+            else
+                match_quads(t, matches[m].first, view_left(),
+                    (page_top(i) + scroll) * vscale, scale);
+        }
+    }
+
+    glColor3f(1.0f, 1.0f, 0.4f);
+    batch_draw();
+
+    if (current) {
+        i = matches[match_current].pagenum;
+        t = pages[i].text;
+        match_quads(t, matches[match_current].first, view_left(),
+            (page_top(i) + scroll) * vscale, lw * vscale / t->width);
+        glColor3f(1.0f, 0.6f, 0.2f);
+        batch_draw();
+    }
+
+    glDisable(GL_BLEND);
+    glEnable(GL_TEXTURE_2D);
+    glColor3f(1.0f, 1.0f, 1.0f);
+}
+
 static void handle_key_up(SDL_keysym * keysym) {
     switch (keysym->sym) {
         case SDLK_DOWN:
@@ -482,11 +4486,17 @@ static void handle_key_up(SDL_keysym * keysym) {
 
 static void handle_key_down(SDL_keysym * keysym)
 {
-    unsigned int i;
+    if (searching) {
+        search_key(keysym);
+        return;
+    }
 
     switch (keysym->sym) {
     case SDLK_ESCAPE:
-        quit_tutorial(0);
+        if (search_len)
+            search_end();
+        else
+            quit_tutorial(0);
         break;
 
     case SDLK_DOWN:
@@ -499,13 +4509,14 @@ static void handle_key_down(SDL_keysym * keysym)
         key_button_down |= LEAST_KEY_UP;
         break;
 
+    /* Scroll by the page at the top of the window, or the one above it */
     case SDLK_PAGEDOWN:
-        scroll -= imh + 20;
+        scroll -= overview ? h : page_span(page_at(-scroll));
         redraw = 1;
         break;
 
     case SDLK_PAGEUP:
-        scroll += imh + 20;
+        scroll += overview ? h : page_span(page_at(-scroll - 1));
         redraw = 1;
         break;
 
@@ -515,40 +4526,57 @@ static void handle_key_down(SDL_keysym * keysym)
         break;
 
     case SDLK_END:
-        scroll = -(imh + 20) * (pagec - 1);
+        if (overview)
+            scroll = -(float)((pagec - 1) / overview_columns()) * CELL_H;
+        else
+            scroll = -page_top(pagec - 1);
         redraw = 1;
         break;
 
+    case SDLK_o:
+        toggle_overview();
+        break;
+
+    case SDLK_s:
+        toggle_stats();
+        break;
+
+    case SDLK_SLASH:
+        searching = 1;
+        search_len = 0;
+        search_update(0);
+        break;
+
+    case SDLK_n:
+        search_next(keysym->mod & KMOD_SHIFT ? -1 : 1);
+        break;
+
     case SDLK_F5:
-        printf("refresh: Killing cache\n");
-
-        /* Kill all stored pages */
-        for (i = 0; i < pagec; i++)
-            if (pages[i].texture) {
-                printf("refresh: Killing page %d\n", i);
-                glDeleteTextures(1, &pages[i].texture);
-                pages[i].texture = 0;
-            } else if (pages[i].rendering) {
-                printf("refresh: Removing render flag from active page %d\n",
-                    i);
-                pages[i].rendering = 0;
-            }
+        /* Re-render everything at the current size right away */
+        rescale();
+        break;
 
-        /* To prevent running renders with old settings from
-         * entering the refreshed cache, mark all threads
-         * as in pre-refresh state.
-         */
-        for (i = 0; i < (unsigned int)thread_count; i++)
-            threads[i].pre_refresh = 1;
-        printf("refresh: Marked %d running threads as pre-refresh renders\n",
-            thread_count - idle_thread_count);
+    case SDLK_PLUS:
+    case SDLK_EQUALS:
+        zoom_by(ZOOM_STEP, h / 2);
+        break;
 
-        /* Finally update the render resolution to current window size */
-        printf("refresh: Changing size lock from %.2fx%.2f to %.2fx%.2f\n",
-            lw, lh, w, h);
+    case SDLK_MINUS:
+        zoom_by(1 / ZOOM_STEP, h / 2);
+        break;
 
-        lw = w;
-        lh = h;
+    case SDLK_0:
+        zoom_by(1 / zoom, h / 2);
+        break;
+
+    case SDLK_LEFT:
+    case SDLK_h:
+        pan_by(w / 10);
+        break;
+
+    case SDLK_RIGHT:
+    case SDLK_l:
+        pan_by(-w / 10);
         break;
 
     case SDLK_F11:
@@ -569,10 +4597,76 @@ static void handle_key_down(SDL_keysym * keysym)
     }
 }
 
+static struct least_link *hover_link; /* Link under the mouse, or NULL */
+
+/* Returns the link at window position ('x', 'y') in the page view */
+static struct least_link *link_under(int x, int y)
+{
+    struct least_page_links *pl;
+    float units = -scroll + y / view_scale();
+    int pagenum;
+
+    if (overview || !pagec)
+        return NULL;
+
+    pagenum = page_at(units);
+    pl = pages[pagenum].links;
+    if (!pl || !pl->width)
+        return NULL;
+
+    return link_at(pl, (x - view_left()) * pl->width / (w * zoom),
+        (units - page_top(pagenum)) * pl->width / lw);
+}
+
+/* Shows the target of 'link'. The position on the target page is in points,
+ * so it is only used once the width of that page is known.
+ */
+static void follow_link(struct least_link *link)
+{
+    struct least_page_links *pl;
+    float width = 0;
+
+    if (link->target < 0) {
+        least_info("Link: %s\n", link->uri);
+        return;
+    }
+
+    link_clicks++;
+    if (pages[link->target].texture && !pages[link->target].preview)
+        link_clicks_ready++;
+
+    pl = pages[link->target].links;
+    if (pl)
+        width = pl->width;
+    else if (pages[link->target].text)
+        width = pages[link->target].text->width;
+
+    jump_to_page(link->target);
+    if (width)
+        scroll -= link->target_y * lw / width;
+
+    hover_link = NULL;
+    link_prefetch = -1;
+}
+
 static void handle_mouse_down(SDL_MouseButtonEvent *event) {
+    int pagenum;
+    struct least_link *link;
+
     switch (event->button) {
         case 1:
             mouse_button_down |= 1 << 1;
+
+            /* Clicking a thumbnail opens its page */
+            if (overview) {
+                pagenum = overview_page_at(event->x, event->y);
+                if (pagenum >= 0)
+                    jump_to_page(pagenum);
+            } else {
+                link = link_under(event->x, event->y);
+                if (link)
+                    follow_link(link);
+            }
             break;
         case 2:
             mouse_button_down |= 1 << 2;
@@ -581,11 +4675,17 @@ static void handle_mouse_down(SDL_MouseButtonEvent *event) {
             mouse_button_down |= 1 << 3;
             break;
         case 4:
-            scroll += 100;
+            if (SDL_GetModState() & KMOD_CTRL)
+                zoom_by(ZOOM_STEP, event->y);
+            else
+                scroll += 100;
             redraw = 1;
             break;
         case 5:
-            scroll -= 100;
+            if (SDL_GetModState() & KMOD_CTRL)
+                zoom_by(1 / ZOOM_STEP, event->y);
+            else
+                scroll -= 100;
             redraw = 1;
             break;
     }
@@ -605,11 +4705,13 @@ static void handle_mouse_up(SDL_MouseButtonEvent *event) {
             mouse_button_down &= ~(1 << 3);
             break;
         case 4:
-            scroll += 100;
+            if (!(SDL_GetModState() & KMOD_CTRL))
+                scroll += 100;
             redraw = 1;
             break;
         case 5:
-            scroll -= 100;
+            if (!(SDL_GetModState() & KMOD_CTRL))
+                scroll -= 100;
             redraw = 1;
             break;
     }
@@ -625,11 +4727,16 @@ static void handle_mouse_motion(SDL_MouseMotionEvent *event) {
                     event->xrel, event->yrel);
                     */
             scroll += event->yrel * 2;
+            if (!overview)
+                pan_by(event->xrel);
             redraw = 1;
         }
 
     }
 
+    /* Render the target of a hovered link ahead, see update_cache */
+    hover_link = link_under(event->x, event->y);
+    link_prefetch = hover_link ? hover_link->target : -1;
 }
 
 static void toggle_fullscreen(void) {
@@ -637,7 +4744,7 @@ static void toggle_fullscreen(void) {
     info = SDL_GetVideoInfo();
 
     if (!info) {
-        puts("Oops - can't get video info");
+        least_warn("Oops - can't get video info\n");
     }
 
     if (!fullscreen) {
@@ -654,8 +4761,8 @@ static void toggle_fullscreen(void) {
         h = prev_h;
     }
 
-
-    redraw = 1;
+    pan_by(0);
+    rescale_request();
 }
 
 static void handle_resize(SDL_ResizeEvent e) {
@@ -663,10 +4770,42 @@ static void handle_resize(SDL_ResizeEvent e) {
     w = e.w;
     h = e.h;
 
-    redraw = 1;
+    pan_by(0);
+    rescale_request();
+}
+
+/* Check for non-power-of-two support */
+static void detect_npot(void)
+{
+    /* printf("Extensions are: %s\n", glGetString(GL_EXTENSIONS)); */
+    if (strstr((const char *)glGetString(GL_EXTENSIONS),
+        "GL_ARB_texture_non_power_of_two")) {
+        least_info("Machine supports NPOT textures.\n");
+        power_of_two = 0;
+    } else {
+        least_info("Machine supports POT textures only.\n");
+        power_of_two = 1;
+    }
 
+    power_of_two |= force_power_of_two;
+}
 
-    return;
+/* Page textures get mipmaps generated by the driver if it can. POT textures
+ * only partly hold their page, the smaller levels would blend the page edges
+ * with the unused part, so they go without.
+ *
+ * Thumbnails need none, the overview shows them at the size they were
+ * rendered at.
+ */
+static void detect_mipmap(void)
+{
+    if (use_mipmap && (power_of_two ||
+            !strstr((const char *)glGetString(GL_EXTENSIONS),
+            "GL_SGIS_generate_mipmap")))
+        use_mipmap = 0;
+
+    least_info(use_mipmap ? "Page textures have mipmaps.\n" :
+        "Page textures have no mipmaps.\n");
 }
 
 static void setup_opengl(int width, int height)
@@ -678,6 +4817,9 @@ static void setup_opengl(int width, int height)
 
     glEnable(GL_TEXTURE_2D);
 
+    /* Pixmap rows are tightly packed, RGB and gray rows are not aligned */
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
     /* Set the clear color. */
     glClearColor(0, 0, 0, 0);
 
@@ -699,7 +4841,7 @@ int setup_sdl(void)
     int flags = 0;
 
     /* First, initialize SDL's video subsystem. */
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0) {
         /* Failed, exit. */
         fprintf(stderr, "Video initialisation failed: %s\n",
             SDL_GetError());
@@ -720,7 +4862,7 @@ int setup_sdl(void)
      */
     gl_w = w = info->current_w;
     gl_h = h = info->current_h;
-    printf("W, H: (%f, %f)\n", w, h);
+    least_debug("W, H: (%f, %f)\n", w, h);
 
     bpp = info->vfmt->BitsPerPixel;
 
@@ -746,6 +4888,9 @@ int setup_sdl(void)
     SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 16);
     SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
 
+    /* Swap on display refresh, see frame_wait */
+    SDL_GL_SetAttribute(SDL_GL_SWAP_CONTROL, 1);
+
     /* flags = SDL_OPENGL | SDL_FULLSCREEN; */
     flags = SDL_OPENGL | SDL_RESIZABLE | SDL_DOUBLEBUF;
     /* flags = SDL_OPENGL; */
@@ -763,59 +4908,129 @@ int setup_sdl(void)
 
     SDL_WM_SetCaption("least", "least");
 
+    /* Search queries are typed as characters, not keys */
+    SDL_EnableUNICODE(1);
+
+    SDL_GL_GetAttribute(SDL_GL_SWAP_CONTROL, &vsync);
+    least_info("Vsync: %s\n", vsync > 0 ? "on" : "off");
+    vsync = vsync > 0;
+
     return 0;
 }
 
-static void process_events(void)
+/* Returns 1 while the view scrolls by itself, needing a frame every refresh */
+static int animating(void)
 {
-    /* Our SDL event placeholder. */
-    SDL_Event event;
+    return (autoscroll && autoscroll_var) || key_button_down;
+}
 
-    /* Only poll + sleep if we are autoscrolling or doing
-     * something else that is interactive */
-    if (((autoscroll) && autoscroll_var) || key_button_down) {
-        if (!SDL_PollEvent(&event)) {
-            /* If we add a sleep, the scrolling won't be super smooth.
-             * Regardless, I think we need to find something to make sure we
-             * don't eat 100% cpu just checking for events.
-             *
-             * I found that 10ms is not a bad wait. Theoretically we want to
-             * wait 1000ms / fps (usually 60) -> 16ms.
-             * */
-            usleep(16000);
-
-            if (autoscroll) {
-                if (key_button_down & LEAST_KEY_DOWN)
-                    autoscroll_var += 1;
-
-                if (key_button_down & LEAST_KEY_UP)
-                    autoscroll_var -= 1;
-
-                scroll -= autoscroll_var;
-            } else {
-                if (key_button_down & LEAST_KEY_DOWN)
-                    scroll -= 5;
+/* Advances autoscroll and key scrolling to 'now'. Speeds are in units per
+ * 1/60 s, so scrolling keeps its pace whatever the frame rate.
+ */
+static void animate(double now)
+{
+    float ticks = frame_animated ? (now - animate_time) * 60 : 1;
 
-                if (key_button_down & LEAST_KEY_UP)
-                    scroll += 5;
-            }
+    animate_time = now;
 
-            redraw = 1;
-        }
+    /* Do not jump ahead after a stall */
+    if (ticks > 4)
+        ticks = 4;
+
+    if (autoscroll) {
+        if (key_button_down & LEAST_KEY_DOWN)
+            autoscroll_var += 1;
+
+        if (key_button_down & LEAST_KEY_UP)
+            autoscroll_var -= 1;
+
+        scroll -= autoscroll_var * ticks;
     } else {
-        SDL_WaitEvent(&event);
+        if (key_button_down & LEAST_KEY_DOWN)
+            scroll -= 5 * ticks;
+
+        if (key_button_down & LEAST_KEY_UP)
+            scroll += 5 * ticks;
+    }
+
+    redraw = 1;
+}
+
+/* Sleeps a little if the next frame is not due yet, returns 0 once it is.
+ * With nothing to draw no frame is due. With swap control the swap waits
+ * for the refresh itself, we only need to be ready somewhat before it.
+ */
+static int frame_wait(void)
+{
+    double remaining;
+
+    if (!redraw && !animating())
+        return 0;
+
+    remaining = frame_last + frame_interval - least_time();
+    if (vsync)
+        remaining -= FRAME_MARGIN;
+
+    if (remaining <= 0)
+        return 0;
+
+    /* Wake up now and then to handle events */
+    usleep(remaining > 0.002 ? 2000 : remaining * 1e6);
+
+    return 1;
+}
+
+/* Shows the frame drawn by draw_screen and records its timings */
+static void present_frame(void)
+{
+    double now, interval;
+
+    samples_add(&frame_times, frame_work + least_time() - frame_start);
+    frame_work = 0;
+
+    /*
+     * Swap the buffers. This this tells the driver to
+     * render the next frame from the contents of the
+     * back-buffer, and to set all rendering operations
+     * to occur on what was the front-buffer.
+     *
+     * Double buffering prevents nasty visual tearing
+     * from the application drawing on areas of the
+     * screen that are being updated at the same time.
+     */
+    SDL_GL_SwapBuffers();
+
+    /* Frames drawn back to back should be one refresh apart */
+    now = least_time();
+    interval = now - frame_last;
+    if (animating() && frame_animated) {
+        samples_add(&frame_intervals, interval);
+        if (interval > frame_interval * 1.5)
+            frames_dropped += (int)(interval / frame_interval + 0.5) - 1;
     }
 
-next_event:
+    frame_animated = animating();
+    frame_last = now;
+}
+
+static void handle_event(SDL_Event *event)
+{
+    double t = least_time();
 
-    switch (event.type) {
+    switch (event->type) {
     case SDL_KEYDOWN:
-        /* Handle key presses. */
-        handle_key_down(&event.key.keysym);
+        /* Handle key presses. Until the document is open there is
+         * nothing to scroll or search, only Escape works.
+         */
+        if (pagec)
+            handle_key_down(&event->key.keysym);
+        else if (event->key.keysym.sym == SDLK_ESCAPE)
+            quit_tutorial(0);
         break;
 
     case SDL_KEYUP:
-        handle_key_up(&event.key.keysym);
+        if (pagec)
+            handle_key_up(&event->key.keysym);
         break;
 
     case SDL_QUIT:
@@ -824,7 +5039,7 @@ next_event:
         break;
 
     case SDL_VIDEORESIZE:
-        handle_resize(event.resize);
+        handle_resize(event->resize);
         break;
 
     case SDL_VIDEOEXPOSE:
@@ -832,36 +5047,141 @@ next_event:
         break;
 
     case SDL_MOUSEBUTTONDOWN:
-        handle_mouse_down(&event.button);
+        if (pagec)
+            handle_mouse_down(&event->button);
         break;
 
     case SDL_MOUSEBUTTONUP:
-        handle_mouse_up(&event.button);
+        if (pagec)
+            handle_mouse_up(&event->button);
         break;
 
     case SDL_MOUSEMOTION:
-        handle_mouse_motion(&event.motion);
+        if (pagec)
+            handle_mouse_motion(&event->motion);
         break;
 
     /* A thread completed its rendering
      *
-     * The thread structure of the completed job is contained
-     * within the data1 pointer of the event.
+     * The completed job is contained within the data1 pointer
+     * of the event. It only causes a redraw if it is on screen.
      */
     case LEAST_PAGE_COMPLETE:
-        finish_page_render((struct least_thread*)event.user.data1);
+        finish_page_render((struct least_job*)event->user.data1);
+        trace_end("finish", t, -1);
+        break;
+
+    case LEAST_GEOMETRY_UPDATE:
+        geometry_update();
+        redraw = 1;
+        break;
+
+    case LEAST_RESCALE:
+        rescale_settle();
+        break;
+
+    case LEAST_STATS_TICK:
+        stats_update();
         redraw = 1;
         break;
 
+    case LEAST_STATS_DUMP:
+        stats_dump();
+        break;
+
+    }
+
+    frame_work += least_time() - t;
+}
+
+static void process_events(void)
+{
+    /* Our SDL event placeholder. */
+    SDL_Event event;
+
+    /* Sleep until something happens, unless the view scrolls by itself */
+    if (!animating()) {
+        SDL_WaitEvent(&event);
+        handle_event(&event);
+    }
+
+    /* Handle everything else arriving until the next frame is due, so
+     * all of it is drawn at once. This is required for scrolling with the
+     * mouse - without this, it is pretty slow and lags.
+     */
+    do {
+        while (SDL_PollEvent(&event))
+            handle_event(&event);
+    } while (frame_wait());
+
+    frame_start = least_time();
+
+    if (animating())
+        animate(frame_start);
+}
+
+/* Runs a render or text job in render thread 'self' */
+static void render_job(struct least_thread *self, struct least_job *job)
+{
+    double t;
+    int store;
+
+    /* Open our own document handle on the first job, unless this thread
+     * opened the document, see document_open
+     */
+    if (!self->doc) {
+        self->doc = open_document(self->context, doc_filename);
+        if (!self->doc) {
+            fprintf(stderr, "In render thread %d: "
+                "cannot open document\n", self->id);
+            abort();
+        }
+    }
+
+    least_debug("Thread %d: Rendering page %d\n", self->id, job->pagenum);
+
+    /* Previews are not worth keeping on disk, the page itself is */
+    job->pixmap = NULL;
+    t = trace_begin();
+    if (job->kind == LEAST_JOB_TEXT) {
+        job->text = page_to_text(self->context, self->doc,
+            job->pagenum, &job->cookie, &job->links);
+    } else if (disk_cache_dir && job->kind != LEAST_JOB_PREVIEW) {
+        job->pixmap = disk_cache_load(self->context, job);
+        trace_end("disk load", t, job->pagenum);
+
+        /* A hit does not load the page, which brings its links along */
+        if (job->pixmap && job->want_links && !bench)
+            job->links = page_links(self->context, self->doc, job->pagenum);
     }
 
-    /* Clear event, just in case SDL doesn't do this (TODO) */
-    memset(&event, 0, sizeof(SDL_Event));
-    /* If there are more events, handle them before drawing.
-     * This is required for scrolling with the mouse - without this,
-     * it is pretty slow and lags. */
-    if (SDL_PollEvent(&event)) {
-        goto next_event;
+    /* Render a page, the pixmap is NULL if the job got cancelled.
+     * Only visible pages are worth splitting into bands, the benchmark
+     * splits every page.
+     *
+     * A page going to the disk cache is rasterized into memory of its own,
+     * which upload_pixmap copies into a PBO. It is stored once the job is
+     * handed on, see render_thread.
+     */
+    if (!job->pixmap && job->kind != LEAST_JOB_TEXT) {
+        store = disk_cache_dir && job->kind != LEAST_JOB_PREVIEW;
+
+        job->pixmap = page_to_pixmap(self->context, self->doc,
+            job->pagenum, job->width, job->height,
+            job->kind != LEAST_JOB_PAGE ? 1 :
+            bench || job->priority < (int)pagec * 2 ? band_count : 1,
+            &job->cookie,
+            job->pbo && !store ? job->pbo->data : NULL,
+            job->pbo && !store ? job->pbo->size : 0,
+            bench ? NULL : &job->links, &job->times);
+        job->failed = !job->pixmap && !job->cookie.abort;
+
+        if (job->pixmap && store) {
+            self->store = fz_keep_pixmap(self->context, job->pixmap);
+            self->store_page = job->pagenum;
+            self->store_width = job->width;
+            self->store_height = job->height;
+        }
     }
 }
 
@@ -870,9 +5190,12 @@ static int render_thread(void *t)
 {
     SDL_Event my_event;
     struct least_thread *self = t;
+    struct least_job *job;
+    struct least_band_set *set;
+    int band, failed;
+    double start;
 
     my_event.type = LEAST_PAGE_COMPLETE;
-    my_event.user.data1 = t;
 
     /* Store local SDL thread ID (Is this function thread safe? ;-) */
     self->tid = SDL_ThreadID();
@@ -883,72 +5206,241 @@ static int render_thread(void *t)
             self->id);
         abort();
     }
+    self->doc = NULL;
 
-    printf("Render thread %d up and running.\n", self->id);
-    SDL_mutexP(self->mutex);
-    /* Wait for first command */
-    SDL_CondWait(self->cond, self->mutex);
+    trace_register("render", self->id);
 
-    while (self->keep_running) {
+    least_debug("Render thread %d up and running.\n", self->id);
+    SDL_mutexP(queue.lock);
 
-        printf("Thread %d: Rendering page %d\n", self->id, self->pagenum);
+    while (1) {
+        /* Wait for the most urgent job */
+        while (!queue.count && self->keep_running)
+            SDL_CondWait(queue.cond, queue.lock);
 
-        /* Render a page */
-        self->pixmap = page_to_pixmap(self->base_context, self->context, doc, self->pagenum);
-        if (!self->pixmap) {
-            fprintf(stderr, "In render thread %d: "
-                "page_to_pixmap returned NULL\n", self->id);
-            abort();
+        if (!self->keep_running)
+            break;
+
+        job = queue_pop();
+
+        /* Help another thread with a band of its page */
+        if (job->bands) {
+            set = job->bands;
+            free(job);
+
+            band = band_claim(set);
+            if (band < 0)
+                continue;
+
+            idle_thread_count--;
+            SDL_mutexV(queue.lock);
+
+            failed = rasterize_band(self->context, set, band);
+
+            SDL_mutexP(queue.lock);
+            set->failed |= failed;
+            set->done++;
+            idle_thread_count++;
+            SDL_CondBroadcast(band_cond);
+            continue;
+        }
+
+        job->thread = self;
+        job->times.wait = least_time() - job->queued;
+        self->job = job;
+        idle_thread_count--;
+
+        SDL_mutexV(queue.lock);
+
+        if (job->kind == LEAST_JOB_OPEN)
+            document_open(self, job);
+        else
+            render_job(self, job);
+
+        SDL_mutexP(queue.lock);
+
+        self->job = NULL;
+
+        if (bench) {
+            /* Hand completed job to the benchmark loop */
+            bench_done[bench_done_count++] = job;
+            SDL_CondSignal(bench_cond);
+        } else {
+            /* Push completed job to event queue */
+            start = trace_begin();
+            my_event.user.data1 = job;
+            SDL_PushEvent(&my_event);
+            trace_end("event push", start, job->pagenum);
         }
 
-        /* Push completed page to event queue */
-        SDL_PushEvent(&my_event);
+        /* The page is on its way to the screen, now write it to disk */
+        if (self->store) {
+            SDL_mutexV(queue.lock);
 
-        SDL_CondWait(self->cond, self->mutex);
+            start = trace_begin();
+            disk_cache_store(self);
+            trace_end("disk store", start, self->store_page);
+            fz_drop_pixmap(self->context, self->store);
+            self->store = NULL;
+
+            SDL_mutexP(queue.lock);
+        }
+
+        idle_thread_count++;
     }
 
-    SDL_mutexV(self->mutex);
+    SDL_mutexV(queue.lock);
 
     /* Cleanup */
+    if (self->doc)
+        fz_drop_document(self->context, self->doc);
     fz_drop_context(self->context);
 
     return 0;
 }
 
-static void draw_screen(void)
+/* Geometry prepass thread entry
+ *
+ * Bounds every page on its own document handle, so it never waits for the
+ * render threads. Results are handed to the main thread in batches, at most
+ * ten times per second, so the layout is rebuilt a bounded number of times
+ * however many pages the document has.
+ */
+static int geometry_thread(void *base_context)
 {
+    SDL_Event my_event;
+    fz_context *context;
+    fz_document *d;
     unsigned int i;
-    unsigned int
-        page_offset,
-        pages_rendered;
-    int ww, hh;
+    double last = 0, t;
+    float aspect;
+
+    my_event.type = LEAST_GEOMETRY_UPDATE;
+
+    context = fz_clone_context(base_context);
+    if (!context) {
+        fprintf(stderr, "In geometry thread: fz_clone_context returned NULL\n");
+        abort();
+    }
+
+    d = open_document(context, doc_filename);
+    if (!d) {
+        fprintf(stderr, "In geometry thread: cannot open document\n");
+        abort();
+    }
+
+    trace_register("geometry", -1);
+
+    for (i = 1; i < pagec; i++) {
+        /* Keep the estimate for pages that fail to load */
+        t = trace_begin();
+        aspect = bound_page(context, d, i);
+        trace_end("bound", t, i);
+        if (!aspect) {
+            least_warn("Cannot bound page %u\n", i);
+            aspect = pages[0].aspect;
+        }
+
+        SDL_mutexP(geometry_lock);
+        bound_aspects[i] = aspect;
+        bound_count = i + 1;
+        SDL_mutexV(geometry_lock);
+
+        if (i + 1 == pagec || least_time() - last > 0.1) {
+            last = least_time();
+            SDL_PushEvent(&my_event);
+        }
+    }
+
+    fz_drop_document(context, d);
+    fz_drop_context(context);
+
+    return 0;
+}
+
+/* Starts the geometry prepass, once the document is open */
+static void init_geometry_thread(fz_context *context)
+{
+    geometry_start = least_time();
+
+    if (pagec > 1 && !SDL_CreateThread(geometry_thread, context)) {
+        fprintf(stderr, "Creating thread failed: %s\n", SDL_GetError());
+        abort();
+    }
+}
+
+/* Draws the overview grid, one draw call per atlas */
+static void draw_overview(void)
+{
+    int i, first, last;
+    float x, y, s0, t0, s1, t1;
+    struct least_thumb_slot *slot;
+
+    glEnable(GL_TEXTURE_2D);
+
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+
+    glClearColor(0.5f, 0.5f, 0.5f, 0.0f);
+    glViewport(0, 0, (int)w, (int)gl_h);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0.0f, (int)w, (int)gl_h, 0, -1.0f, 1.0f);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    glColor3f(1.0, 1.0, 1.0);
+
+    overview_range(&first, &last);
+
+    for (i = first; i <= last; i++) {
+        overview_cell(i, &x, &y);
+
+        /* Pages without a thumbnail yet */
+        if (!pages[i].thumb) {
+            batch_quad(busy_texture, x, y, x + THUMB_W, y + THUMB_H,
+                0, 0, 4, 4);
+            continue;
+        }
+
+        slot = thumbs + pages[i].thumb - 1;
+        slot->used = ++thumb_clock;
+        thumb_coords(pages[i].thumb - 1, &s0, &t0, &s1, &t1);
+
+        /* Center the thumbnail in its cell */
+        x += (THUMB_W - slot->w) / 2;
+        y += (THUMB_H - slot->h) / 2;
+
+        batch_quad(atlas_textures[(pages[i].thumb - 1) / atlas_cells],
+            x, y, x + slot->w, y + slot->h, s0, t0, s1, t1);
+    }
+
+    batch_draw();
+}
+
+static void draw_screen(void)
+{
+    int i, first, last, busy = 0;
     int pow2_ww, pow2_hh;
-    float tsm, ttm, tsc, ttc;
+    float tsc, ttc, ts0, tt0;
+    GLuint texture;
 
     /* View dimensions of pages */
-    float vw, vh;
+    float vw, vh, vx, vy, vscale;
     /* static float vloot = 0.f; */
 
-    ww = imw;
-    hh = imh;
+    if (overview) {
+        draw_overview();
+        draw_stats();
+        return;
+    }
 
     glEnable(GL_TEXTURE_2D);
 
     glMatrixMode(GL_TEXTURE);
     glLoadIdentity();
 
-    /* Setup texture matrix to certain scale whenever pow2 is required */
-    if (power_of_two) {
-        RPOW2(pow2_ww, ww);
-        RPOW2(pow2_hh, hh);
-        glScalef(ww / (float)pow2_ww, hh / (float)pow2_hh, 1.0f);
-        ttm = (float)pow2_hh / hh * 8;
-        tsm = (float)pow2_ww / ww * 8;
-    } else {
-        tsm = 8;
-        ttm = 8;
-    }
-
     glClearColor(0.5f, 0.5f, 0.5f, 0.0f);
     glViewport(0, 0, (int)w, (int)gl_h);
     /* glViewport(0, 0, 400, 400); */
@@ -964,81 +5456,66 @@ static void draw_screen(void)
     glRotatef(vloot, 0.f, 0.f, 1.0f);
     */
 
-    /* Compute pageview dimensions */
-    vw = w;
-    vh = (vw / ww) * hh;
-
-    pages_rendered = h / (vh + (vh / imh) * 20) + 2;
-
-    if (scroll < (imh + 20) * pages_rendered) {
-        /* Scale based scroll */
-        if (scroll > 0)
-            glTranslatef(0.f, scroll, 0.f);
-        else
-            glTranslatef(0.f, fmod(scroll, imh + 20) * (vh / imh) , 0.f);
-        page_offset = fmax(-scroll / (float)(imh + 20), 0);
-        /*printf("page_offset: %d\n", page_offset); */
-        /*printf("pages_rendered: %d\n", pages_rendered);*/
+    /* Pages are zoomed from the window width, scroll units are scaled to
+     * match. Textures of another render width are stretched until they
+     * are replaced, see rescale.
+     */
+    vw = w * zoom;
+    vx = view_left();
+    vscale = view_scale();
 
+    /* A busy A4 shaped page while the document is opened */
+    if (!pagec) {
         glColor3f(1.0, 1.0, 1.0);
-        for (i = page_offset; i < page_offset + pages_rendered &&
-                i < pagec; i++) {
-            /* printf("Page: %d, size: (%f, %f)\n", i, imw, imh); */
-
-            /* printf("Binding texture: %d\n", pages[i].texture); */
-            if (pages[i].texture) {
-                /* printf("Binding texture: %d\n", pages[i].texture); */
-                glBindTexture(GL_TEXTURE_2D, pages[i].texture);
-                tsc = ttc = 1;
-            } else {
-                /* puts("Binding busy"); */
-                glBindTexture(GL_TEXTURE_2D, busy_texture);
-                tsc = tsm;
-                ttc = ttm;
-            }
-            /* printf("OpenGL error: %s\n", gluErrorString(glGetError())); */
-            /* Send our triangle data to the pipeline. */
-            glBegin(GL_QUADS);
-
-            /* Bottom-left vertex (corner) */
-            glTexCoord2f(0, 0);
-            glVertex3f(0.f, 0.f, 0.0f);
-
-            /* Bottom-right vertex (corner) */
-            glTexCoord2f(tsc, 0);
-            glVertex3f(vw, 0.f, 0.f);
+        batch_quad(busy_texture, vx, 0, vx + vw, vw * M_SQRT2, 0, 0, 8, 8);
+        batch_draw();
+        draw_stats();
+        return;
+    }
 
-            /* Top-right vertex (corner) */
-            glTexCoord2f(tsc, ttc);
-            glVertex3f(vw, vh, 0.f);
+    visible_range(&first, &last);
 
-            /* Top-left vertex (corner) */
-            glTexCoord2f(0, ttc);
-            glVertex3f(0.f, vh, 0.f);
+    glColor3f(1.0, 1.0, 1.0);
+    for (i = first; i <= last; i++) {
+        vy = (page_top(i) + scroll) * vscale;
+        vh = pages[i].aspect * lw * vscale;
 
-            glEnd();
-            /*
-            if (i % 2 == 0)
-                glTranslatef(ww + 20, 0.f, 0.f);
-            else {
-                glTranslatef(-ww -20, hh + 20, 0.f);
+        ts0 = tt0 = 0;
+        if (pages[i].texture) {
+            texture = pages[i].texture;
+            pages[i].used = ++page_clock;
+            tsc = ttc = 1;
+
+            /* Only part of a POT texture holds the page */
+            if (power_of_two) {
+                RPOW2(pow2_ww, pages[i].tw);
+                RPOW2(pow2_hh, pages[i].th);
+                tsc = pages[i].tw / (float)pow2_ww;
+                ttc = pages[i].th / (float)pow2_hh;
             }
-            */
-            glTranslatef(0.0f, vh + (vh / imh) * 20, 0.f);
+        } else if (pages[i].thumb) {
+            /* Stretch the overview thumbnail until the page is rendered */
+            thumbs[pages[i].thumb - 1].used = ++thumb_clock;
+            texture = atlas_textures[(pages[i].thumb - 1) / atlas_cells];
+            thumb_coords(pages[i].thumb - 1, &ts0, &tt0, &tsc, &ttc);
+        } else {
+            texture = busy_texture;
+            tsc = 8;
+            ttc = 8;
+            busy = 1;
         }
-    }
 
-    /*
-     * Swap the buffers. This this tells the driver to
-     * render the next frame from the contents of the
-     * back-buffer, and to set all rendering operations
-     * to occur on what was the front-buffer.
-     *
-     * Double buffering prevents nasty visual tearing
-     * from the application drawing on areas of the
-     * screen that are being updated at the same time.
-     */
-    SDL_GL_SwapBuffers();
+        batch_quad(texture, vx, vy, vx + vw, vy + vh, ts0, tt0, tsc, ttc);
+    }
+
+    batch_draw();
+    draw_matches(first, last, vscale);
+    draw_stats();
+
+    if (travelling()) {
+        travel_frames++;
+        busy_frames += busy;
+    }
 }
 
 /* XXX Error handling :-( */
@@ -1052,7 +5529,7 @@ static void init_busy_texture() {
         };
 
     glGenTextures(1, &busy_texture);
-    printf("Busy texture @ num: %d\n", busy_texture);
+    least_debug("Busy texture @ num: %d\n", busy_texture);
     glBindTexture(GL_TEXTURE_2D, busy_texture);
     DEBUG_GL(glBindTexture);
 
@@ -1083,35 +5560,43 @@ static void init_threads(int thread_count, fz_context *context) {
     /* Fetch current stacksize */
     pthread_attr_init(&attr);
     pthread_attr_getstacksize(&attr, &stack_size);
-    printf("Default stack size: %zu\n", stack_size);
+    least_debug("Default stack size: %zu\n", stack_size);
 
     /* Ensure at least 1MB of stacksize */
     if (stack_size < 1048576) {
         stack_size = 1048576;
-        printf("Changing to %zu\n", stack_size);
+        least_debug("Changing to %zu\n", stack_size);
         pthread_attr_setstacksize(&attr, stack_size);
     } else {
-        puts("This stack size is okay.");
+        least_debug("This stack size is okay.\n");
     }
 #endif
 
     threads = malloc(sizeof(struct least_thread) * thread_count);
-    idle_threads = malloc(sizeof(struct least_thread*) * thread_count);
 
-    for (i = 0; i < thread_count; i++) {
-        /* Setup sync */
-        threads[i].cond  = SDL_CreateCond();
-        if (!threads[i].cond) {
-            fprintf(stderr, "Creating condition failed: %s\n", SDL_GetError());
-            abort();
-        }
-        threads[i].mutex = SDL_CreateMutex();
-        if (!threads[i].mutex) {
-            fprintf(stderr, "Creating mutex failed: %s\n", SDL_GetError());
-            abort();
-        }
+    /* Setup job queue */
+    queue.cond = SDL_CreateCond();
+    if (!queue.cond) {
+        fprintf(stderr, "Creating condition failed: %s\n", SDL_GetError());
+        abort();
+    }
+    queue.lock = SDL_CreateMutex();
+    if (!queue.lock) {
+        fprintf(stderr, "Creating mutex failed: %s\n", SDL_GetError());
+        abort();
+    }
+    band_cond = SDL_CreateCond();
+    if (!band_cond) {
+        fprintf(stderr, "Creating condition failed: %s\n", SDL_GetError());
+        abort();
+    }
+    queue.size = 16;
+    queue.count = 0;
+    queue.heap = malloc(sizeof(struct least_job*) * queue.size);
 
+    idle_thread_count = thread_count;
 
+    for (i = 0; i < thread_count; i++) {
         /* Thread ID */
         threads[i].id = i;
 
@@ -1119,6 +5604,8 @@ static void init_threads(int thread_count, fz_context *context) {
         threads[i].context = NULL;
         threads[i].base_context = context;
         threads[i].keep_running = 1;
+        threads[i].job = NULL;
+        threads[i].store = NULL;
 
         #if 0
         threads[i].context = fz_clone_context(context);
@@ -1135,12 +5622,8 @@ static void init_threads(int thread_count, fz_context *context) {
             fprintf(stderr, "Creating thread failed: %s\n", SDL_GetError());
             abort();
         }
-
-        idle_threads[thread_count - i - 1] = threads + i;
     }
 
-    idle_thread_count = thread_count;
-
     return;
 }
 
@@ -1149,14 +5632,6 @@ static void init_least_context_locks(void)
 {
     int i;
 
-    /* Initialise the Big Fitz Lock */
-    big_fitz_lock = SDL_CreateMutex();
-    if (!big_fitz_lock) {
-        fprintf(stderr, "Mutex initialisation failed: %s\n",
-            SDL_GetError());
-        abort();
-    }
-
     for (i = 0; i < FZ_LOCK_MAX; i++) {
         least_lock_list[i] = SDL_CreateMutex();
         if (!least_lock_list[i]) {
@@ -1169,148 +5644,982 @@ static void init_least_context_locks(void)
     return;
 }
 
-static void schedule_page(int pagenum)
+/* Queues a render job of 'kind' for 'pagenum' at the current render
+ * settings. A preview renders at preview_scale of the full width, a
+ * thumbnail fits a THUMB_W x THUMB_H atlas cell.
+ *
+ * Must be called with queue.lock held.
+ */
+static void schedule_page(int pagenum, int kind, int priority)
 {
-    struct least_thread *t = idle_threads[--idle_thread_count];
+    struct least_job *job = malloc(sizeof(struct least_job));
 
-    /* Mark page in progress */
-    pages[pagenum].rendering = 1;
+    if (!job) {
+        fprintf(stderr, "Out of memory while scheduling page %d\n", pagenum);
+        abort();
+    }
 
-    /* Configure thread */
-    t->pagenum = pagenum;
-    t->scale = ims;
-    t->pre_refresh = 0;
+    /* Mark page in progress and configure job */
+    switch (kind) {
+    case LEAST_JOB_PREVIEW:
+        pages[pagenum].previewing = 1;
+        job->width = lw * preview_scale;
+        job->height = 0;
+        break;
+    case LEAST_JOB_THUMB:
+        pages[pagenum].thumbing = 1;
+        job->width = THUMB_W;
+        job->height = THUMB_H;
+        break;
+    case LEAST_JOB_TEXT:
+        pages[pagenum].indexing = 1;
+        text_jobs++;
+        job->width = 0;
+        job->height = 0;
+        break;
+    default:
+        pages[pagenum].rendering = 1;
+        job->width = lw;
+        job->height = 0;
+        break;
+    }
 
-    /* Start rendering */
-    SDL_mutexP(t->mutex);
-    SDL_CondSignal(t->cond);
-    SDL_mutexV(t->mutex);
+    job->pagenum = pagenum;
+    job->generation = render_generation;
+    job->kind = kind;
+    job->priority = priority;
+    job->deadline = kind == LEAST_JOB_PAGE || kind == LEAST_JOB_PREVIEW ?
+        page_deadline(pagenum) : 0;
+    job->thread = NULL;
+    job->pixmap = NULL;
+    job->text = NULL;
+    job->links = NULL;
+    job->want_links = !pages[pagenum].links;
+    job->bands = NULL;
+    job->pbo = NULL;
+    job->map = NULL;
+    memset(&job->times, 0, sizeof(struct least_render_times));
+    memset(&job->cookie, 0, sizeof(fz_cookie));
+    job->queued = least_time();
+    renders_scheduled[kind]++;
+
+    queue_push(job);
 
     return;
 }
 
+/* Render priority of 'pagenum', lower is more urgent.
+ *
+ * Visible pages come first, then prefetched pages, each ordered by their
+ * distance from the focus page. Within each group previews go first, so
+ * every page quickly shows something.
+ */
+static int page_priority(int pagenum, int kind, int first, int last)
+{
+    int distance = abs(pagenum - page_focus) * 2 + (kind == LEAST_JOB_PAGE);
+
+    if (pagenum >= first && pagenum <= last)
+        return distance;
+
+    /* The target of the hovered link may be clicked any moment */
+    if (pagenum == link_prefetch)
+        return pagec * 2 + (kind == LEAST_JOB_PAGE);
+
+    return pagec * 2 + distance;
+}
+
+/* Render priority of the thumbnail of 'pagenum'.
+ *
+ * In the overview thumbnails on screen [first, last] come first, top to
+ * bottom, then those closest to the screen. In the page view thumbnails are
+ * only rendered once no page is waiting.
+ */
+static int thumb_priority(int pagenum, int first, int last)
+{
+    if (!overview)
+        return pagec * 4 + abs(pagenum - page_focus);
+
+    if (pagenum >= first && pagenum <= last)
+        return pagenum - first;
+
+    return pagec + (pagenum < first ? first - pagenum : pagenum - last);
+}
+
+/* Clears the in progress flag 'job' set in schedule_page */
+static void page_job_done(struct least_job *job)
+{
+    switch (job->kind) {
+    case LEAST_JOB_PREVIEW:
+        pages[job->pagenum].previewing = 0;
+        break;
+    case LEAST_JOB_THUMB:
+        pages[job->pagenum].thumbing = 0;
+        break;
+    case LEAST_JOB_TEXT:
+        pages[job->pagenum].indexing = 0;
+        text_jobs--;
+        break;
+    default:
+        pages[job->pagenum].rendering = 0;
+        break;
+    }
+}
+
+/* Returns 1 if 'job' still needs to be rendered. Pages are needed within the
+ * prefetch window [c_start, c_stop) and the hovered link target unless the
+ * overview is shown, thumbnails within the thumbnail window [t_start, t_stop).
+ * Text is always needed.
+ */
+static int job_wanted(struct least_job *job, int c_start, int c_stop,
+        int t_start, int t_stop)
+{
+    if (job->kind == LEAST_JOB_TEXT)
+        return 1;
+
+    if (job->kind == LEAST_JOB_THUMB)
+        return job->pagenum >= t_start && job->pagenum < t_stop;
+
+    return !overview && ((job->pagenum >= c_start && job->pagenum < c_stop) ||
+        job->pagenum == link_prefetch);
+}
+
 /* This function updates cache state if necessary
  *
  * It schedules render jobs en removes pages no longer
  * needed.
  *
  * The cache currently uses the scroll variable for computing
- * the focus page.
+ * the focus page. The focus page is kept while the overview is shown,
+ * which only schedules thumbnails.
  */
 void update_cache(void)
 {
     int i;
     int
         c_start,
-        c_stop;
-    int kills_left = idle_thread_count;
+        c_stop,
+        v_first,
+        v_last,
+        t_start,
+        t_stop;
+    int window, ahead, victim;
+    float reach;
+    size_t page_bytes;
+    struct least_job *job;
+
+    /* Nothing to schedule before the document is open */
+    if (!pagec)
+        return;
 
     /* Compute page_focus */
-    if (scroll > 0.) {
+    if (overview) {
+        /* Keep the focus of the page view */
+    } else if (scroll > 0.) {
         page_focus = 0;
     } else {
         /* Page focus should be on the page occupying most of the display
          *
-         * Every page takes up imh + 20 units of space in between.
-         * Split the window in 2 to scroll to the middle of the window.
-         * Finally add 10 units of scroll, because only 10 of the 20 units
-         * space belong the page on top of the window. This should create
-         * satisfying focus behaviour.
+         * Take the page in the middle of the window. Add half of the gap,
+         * because only that half of the gap below a page belongs to the
+         * page on top of the window. This should create satisfying focus
+         * behaviour.
          */
-        page_focus = (-scroll + (h / 2) + 10) / (imh + 20);
-        if (page_focus >= (int)pagec)
-            page_focus = pagec - 1;
+        page_focus = page_at(-scroll + h / 2 / view_scale() + PAGE_GAP / 2);
+    }
+
+    track_scroll();
+
+    /* Compute prefetch window size. While travelling it covers the screen
+     * and the pages reached within the prefetch horizon. Pages are estimated
+     * at the average size of the cached ones. The visible pages are always
+     * rendered, whatever the budget.
+     */
+    window = prefetch_pages;
+
+    if (!overview) {
+        visible_range(&v_first, &v_last);
+        stats_view(v_first, v_last);
+
+        if (travelling()) {
+            reach = -scroll + scroll_speed * prefetch_horizon();
+            if (scroll_speed > 0)
+                ahead = page_at(reach + h / view_scale()) - v_first + 1;
+            else
+                ahead = v_last - page_at(reach) + 1;
+
+            if (window < ahead)
+                window = ahead;
+        }
     }
 
-    /* Compute sliding cache window */
-    c_start = page_focus - (pages_to_cache - 1) / 2;
+    page_bytes = texture_pages ? texture_bytes / texture_pages :
+        (size_t)(lw * lw * pages[page_focus].aspect * 3);
+    if (page_bytes && texture_budget / page_bytes < (size_t)window)
+        window = texture_budget / page_bytes;
+
+    if (!overview && window < v_last - v_first + 1)
+        window = v_last - v_first + 1;
+
+    if (window < 1)
+        window = 1;
+
+    /* Compute sliding prefetch window, starting at the screen edge that
+     * trails while travelling
+     */
+    if (travelling() && scroll_speed > 0)
+        c_start = v_first;
+    else if (travelling())
+        c_start = v_last + 1 - window;
+    else
+        c_start = page_focus - (window - 1) / 2;
     if (c_start < 0)
         c_start = 0;
 
-    c_stop = c_start + pages_to_cache;
+    c_stop = c_start + window;
     if (c_stop > (int)pagec) {
         c_stop = pagec;
-        c_start = c_stop - pages_to_cache;
+        c_start = c_stop - window;
         if (c_start < 0)
             c_start = 0;
     }
 
+    /* Compute thumbnail window: the cells on screen and a screen full on
+     * either side in the overview, the prefetch window otherwise. It never
+     * holds more thumbnails than fit in the atlases.
+     */
+    if (overview) {
+        overview_range(&v_first, &v_last);
+        t_start = v_first - (v_last - v_first + 1);
+        t_stop = v_last + 1 + (v_last - v_first + 1);
+        if (t_stop - t_start > thumb_slots) {
+            t_start = v_first;
+            t_stop = v_first + thumb_slots;
+        }
+        if (t_start < 0)
+            t_start = 0;
+        if (t_stop > (int)pagec)
+            t_stop = pagec;
+    } else {
+        t_start = c_start;
+        t_stop = c_stop;
+    }
+
 #if 0
     printf("Page focus is: %d\n", page_focus);
-    printf("Current cache window: [%d, %d)\n", c_start, c_stop);
+    printf("Current prefetch window: [%d, %d)\n", c_start, c_stop);
     printf("Idle thread count: %d\n", idle_thread_count);
 #endif
 
-    /* First kill unnecessary pages in cache */
-    for (i = 0; i < c_start && kills_left; i++) {
-        if (pages[i].texture) {
-            printf("cache: Killing page %d\n", i);
-            glDeleteTextures(1, &pages[i].texture);
-            pages[i].texture = 0;
-            kills_left--;
+    SDL_mutexP(queue.lock);
+
+    /* Reprioritise queued jobs, dropping those no longer wanted */
+    for (i = 0; i < queue.count; ) {
+        job = queue.heap[i];
+
+        if (job->bands) {
+            /* Band tickets stay most urgent */
+            i++;
+        } else if (!job_wanted(job, c_start, c_stop, t_start, t_stop)) {
+            least_debug("cache: Unscheduling page %d\n", job->pagenum);
+            page_job_done(job);
+            queue.heap[i] = queue.heap[--queue.count];
+            job_free(job);
+        } else {
+            if (job->kind == LEAST_JOB_THUMB) {
+                job->priority = thumb_priority(job->pagenum, v_first, v_last);
+            } else if (job->kind != LEAST_JOB_TEXT) {
+                job->priority = page_priority(job->pagenum, job->kind,
+                    v_first, v_last);
+                job->deadline = page_deadline(job->pagenum);
+            }
+            i++;
         }
     }
 
-    for (i = c_stop; i < (int)pagec && kills_left; i++) {
-        if (pages[i].texture) {
-            printf("cache: Killing page %d\n", i);
-            glDeleteTextures(1, &pages[i].texture);
-            pages[i].texture = 0;
-            kills_left--;
+    /* Cancel renders of pages that left the prefetch window. Pages being
+     * rendered when the overview is opened may complete.
+     */
+    for (i = 0; i < thread_count; i++) {
+        job = threads[i].job;
+        if (job && !job->cookie.abort &&
+                (job->kind == LEAST_JOB_THUMB || !overview) &&
+                !job_wanted(job, c_start, c_stop, t_start, t_stop)) {
+            least_debug("cache: Cancelling page %d\n", job->pagenum);
+            job->cookie.abort = 1;
+        } else if (job && (job->kind == LEAST_JOB_PAGE ||
+                job->kind == LEAST_JOB_PREVIEW)) {
+            job->deadline = page_deadline(job->pagenum);
+        }
+    }
+
+    /* Evict the least recently shown pages outside the prefetch window
+     * until the textures fit in the budget again
+     */
+    while (texture_bytes > texture_budget) {
+        victim = -1;
+        for (i = 0; i < (int)pagec; i++) {
+            if (!pages[i].texture || (i >= c_start && i < c_stop) ||
+                    i == link_prefetch)
+                continue;
+
+            if (victim < 0 || pages[i].used < pages[victim].used)
+                victim = i;
+        }
+
+        if (victim < 0)
+            break;
+
+        least_debug("cache: Killing page %d\n", victim);
+        page_texture_release(victim);
+    }
+
+    /* Schedule new pages, with a quick preview first if there is nothing
+     * to show yet.
+     */
+    for (i = c_start; i < c_stop && !overview; i++) {
+        if (pages[i].failed)
+            continue;
+
+        if (preview_scale > 0 && !pages[i].texture &&
+                !pages[i].previewing && !pages[i].rendering) {
+            least_debug("cache: Scheduling preview of page %d\n", i);
+            schedule_page(i, LEAST_JOB_PREVIEW,
+                page_priority(i, LEAST_JOB_PREVIEW, v_first, v_last));
+        }
+
+        if ((!pages[i].texture || pages[i].preview || page_stale(i)) &&
+                !pages[i].rendering) {
+            least_debug("cache: Scheduling page %d\n", i);
+            schedule_page(i, LEAST_JOB_PAGE,
+                page_priority(i, LEAST_JOB_PAGE, v_first, v_last));
         }
     }
 
-    /* Schedule new pages */
-    for (i = c_start; i < c_stop && idle_thread_count; i++) {
-        if (!pages[i].texture && !pages[i].rendering) {
-            printf("cache: Scheduling page %d\n", i);
-            schedule_page(i);
+    /* Render the target of the hovered link, so clicking it is instant */
+    i = link_prefetch;
+    if (i >= 0 && !overview && !pages[i].failed && (!pages[i].texture ||
+            pages[i].preview || page_stale(i)) && !pages[i].rendering) {
+        least_debug("cache: Scheduling link target page %d\n", i);
+        schedule_page(i, LEAST_JOB_PAGE,
+            page_priority(i, LEAST_JOB_PAGE, v_first, v_last));
+    }
+
+    /* Thumbnails are rendered in the background, so they are ready when
+     * the overview is opened.
+     */
+    for (i = t_start; i < t_stop; i++) {
+        if (!pages[i].thumb && !pages[i].thumbing && !pages[i].failed) {
+            least_debug("cache: Scheduling thumbnail of page %d\n", i);
+            schedule_page(i, LEAST_JOB_THUMB,
+                thumb_priority(i, v_first, v_last));
+        }
+    }
+
+    /* Index the text of the document in page order once nothing else is
+     * waiting. Only a few pages are queued at a time, and one thread is left
+     * for pages coming into view.
+     */
+    while (text_next < (int)pagec &&
+            text_jobs < (thread_count > 1 ? thread_count - 1 : 1)) {
+        if (!pages[text_next].text && !pages[text_next].indexing)
+            schedule_page(text_next, LEAST_JOB_TEXT,
+                pagec * 8 + text_next);
+        text_next++;
+    }
+
+    /* A page waiting for a busy thread cancels text extraction, which is
+     * queued again when it returns, see finish_text
+     */
+    for (i = 0; i < queue.count; i++)
+        if (queue.heap[i]->kind == LEAST_JOB_PAGE ||
+                queue.heap[i]->kind == LEAST_JOB_PREVIEW)
+            break;
+
+    if (!idle_thread_count && i < queue.count)
+        for (i = 0; i < thread_count; i++) {
+            job = threads[i].job;
+            if (job && job->kind == LEAST_JOB_TEXT && !job->cookie.abort) {
+                least_debug("cache: Cancelling text of page %d\n",
+                    job->pagenum);
+                job->cookie.abort = 1;
+            }
         }
+
+    queue_heapify();
+
+    /* Hand free PBOs to queued page jobs, so they rasterize straight into
+     * upload memory. The heap array is ordered by level, so the most urgent
+     * jobs roughly come first. The size follows from the page geometry.
+     */
+    for (i = 0; i < queue.count && use_pbo; i++) {
+        job = queue.heap[i];
+        if (job->kind != LEAST_JOB_PAGE || job->pbo)
+            continue;
+
+        job->pbo = pbo_get((size_t)(lw + 2) *
+            (lw * pages[job->pagenum].aspect + 2) * 3);
+        if (!job->pbo)
+            break;
+    }
+
+    if (queue.count)
+        SDL_CondBroadcast(queue.cond);
+
+    SDL_mutexV(queue.lock);
+}
+
+/* Keeps the link index a job loaded, unless the page already has one */
+static void finish_links(struct least_job *job)
+{
+    if (job->links && !pages[job->pagenum].links)
+        pages[job->pagenum].links = job->links;
+    else
+        links_free(job->links);
+
+    job->links = NULL;
+}
+
+/* Adds the index of a completed LEAST_JOB_TEXT to its page and searches it.
+ * Text does not depend on the render settings, so text jobs survive a
+ * rescale and are kept whatever their generation. A cancelled page is
+ * indexed again later.
+ */
+static void finish_text(struct least_job *job)
+{
+    int pagenum = job->pagenum, count = match_count;
+    unsigned int percent = text_indexed * 100 / pagec;
+
+    page_job_done(job);
+
+    if (!job->text && job->cookie.abort && pagenum < text_next)
+        text_next = pagenum;
+
+    if (!job->text || pages[pagenum].text) {
+        free(job->text);
+        job_free(job);
+        return;
     }
+
+    pages[pagenum].text = job->text;
+    text_indexed++;
+    text_bytes += job->text->size;
+    job_free(job);
+
+    if (searching || search_len) {
+        search_page(pagenum);
+        if (match_count != count && !overview && page_on_screen(pagenum))
+            redraw = 1;
+        if (match_count != count || text_indexed * 100 / pagec != percent)
+            search_status();
+    }
+
+    if (text_indexed == pagec)
+        least_info("Indexed the text of %u pages, %.1f MB\n", pagec,
+            text_bytes / (1024. * 1024.));
 }
 
 /* This function completes a rendering job.
  *
- * The thread is added to the pool of idle threads.
+ * Jobs of an older render generation are discarded, as are previews of pages
+ * that already have their full resolution texture. A full resolution render
+ * replaces the preview texture. Thumbnails go into an atlas.
  */
-static void finish_page_render(struct least_thread *render)
+static void finish_page_render(struct least_job *job)
 {
-    union _dispose_volatile {
-        volatile fz_pixmap *volatile_pixmap;
-        fz_pixmap *pixmap;
-    } d;
+    fz_context *context = job->thread->context;
+
+    if (job->kind == LEAST_JOB_OPEN) {
+        context = job->thread->base_context;
+        if (document_ready(job))
+            quit_tutorial(1);
+        init_geometry_thread(context);
+        redraw = 1;
+        return;
+    }
 
-    d.volatile_pixmap = render->pixmap;
+    finish_links(job);
+
+    if (job->kind == LEAST_JOB_TEXT) {
+        finish_text(job);
+        return;
+    }
+
+    /* A damaged page is not tried again, it keeps the busy texture */
+    if (job->failed) {
+        renders_failed++;
+        pages[job->pagenum].failed = 1;
+    }
+
+    if (!job->pixmap) {
+        least_debug("finish_page: Render of page %d by thread %d "
+            "was cancelled\n", job->pagenum, job->thread->id);
+        renders_cancelled += !job->failed;
+
+        if (job->generation == render_generation)
+            page_job_done(job);
+
+        job_free(job);
+        return;
+    }
+
+    stats_add_times(&job->times);
+
+    if (job->generation != render_generation) {
+        least_debug("finish_page: Discarding stale render "
+            "of page %d by thread %d\n", job->pagenum, job->thread->id);
+        renders_discarded++;
+    } else if (job->kind == LEAST_JOB_THUMB) {
+        renders_completed++;
+        page_job_done(job);
+
+        thumb_store(job->pagenum,
+            (void*)fz_pixmap_samples(context, job->pixmap),
+            fz_pixmap_width(context, job->pixmap),
+            fz_pixmap_height(context, job->pixmap),
+            pixmap_format(context, job->pixmap));
+
+        /* The page view shows thumbnails of pages it has no texture for */
+        if (page_on_screen(job->pagenum) &&
+                (overview || !pages[job->pagenum].texture))
+            redraw = 1;
+    } else if (job->kind == LEAST_JOB_PREVIEW &&
+            pages[job->pagenum].texture) {
+        /* The full resolution page beat its preview */
+        page_job_done(job);
+        renders_discarded++;
+    } else {
+        renders_completed++;
 
-    /* XXX Error handling ? */
-    if (render->pre_refresh)
-        printf("finish_page: Discarding pre-refresh render "
-            "of page %d by thread %d\n", render->pagenum, render->id);
-    else {
         /* Page is complete and no longer rendering */
-        pages[render->pagenum].rendering = 0;
+        page_job_done(job);
+
+        if (!pages[job->pagenum].texture)
+            deadline_account(job->deadline);
+
+        if (!first_page_time) {
+            first_page_time = least_time() - open_start;
+            least_info("First page shown after %.0f ms\n",
+                first_page_time * 1e3);
+        }
+
+        /* Replace the preview, if any */
+        page_texture_release(job->pagenum);
+        pages[job->pagenum].preview = job->kind == LEAST_JOB_PREVIEW;
 
         /* Convert to texture */
-        pages[render->pagenum].texture = pixmap_to_texture(
-            (void*)fz_pixmap_samples(render->context, d.pixmap),
-            fz_pixmap_width(render->context, d.pixmap),
-            fz_pixmap_height(render->context, d.pixmap), 0, 0);
+        page_texture_set(job->pagenum, upload_pixmap(context, job),
+            fz_pixmap_width(context, job->pixmap),
+            fz_pixmap_height(context, job->pixmap),
+            pixmap_format(context, job->pixmap));
+
+        if (job->kind == LEAST_JOB_PAGE) {
+            geometry_learn(job->pagenum, fz_pixmap_width(context, job->pixmap),
+                fz_pixmap_height(context, job->pixmap));
+
+            render_time_avg += (job->times.load + job->times.list +
+                job->times.raster - render_time_avg) * 0.1;
+        }
+
+        if (!overview && page_on_screen(job->pagenum))
+            redraw = 1;
     }
 
     /* XXX Using the threads context might not be a gr8 idea */
-    fz_drop_pixmap(render->context, d.pixmap);
+    fz_drop_pixmap(context, job->pixmap);
+
+    job_free(job);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options] file.pdf\n"
+        "\n"
+        "Options:\n"
+        "  --threads N     Number of render threads\n"
+        "  --list-cache N  Display lists to keep cached (default 32)\n"
+        "  --cache-mb N    Keep up to N MB of page textures (default 256)\n"
+        "  --disk-cache D  Keep rendered pages in directory D\n"
+        "  --disk-cache-mb N\n"
+        "                  Keep up to N MB in the disk cache (default 1024)\n"
+        "  --bands N       Rasterize visible pages in N bands in parallel\n"
+        "                  (default 1)\n"
+        "  --preview F     Show a preview at F times the resolution first\n"
+        "                  (default 0.25, 0 disables)\n"
+        "  --no-pbo        Upload textures synchronously, without PBOs\n"
+        "  --no-mipmap     Do not give page textures mipmaps\n"
+        "  --no-gray       Render gray pages in colour too\n"
+        "  --fps N         Display refresh rate to pace frames to\n"
+        "                  (default 60)\n"
+        "  --trace F       Write a Chrome trace-event timeline to F on exit\n"
+        "  --log-level L   error, warn, info (default) or debug; debug\n"
+        "                  messages are left out of release builds\n"
+        "  --bench         Render all pages without a window, report timings\n"
+        "\n"
+        "Benchmark options:\n"
+        "  --gl            Also time texture uploads (opens a window)\n"
+        "  --passes N      Render every page N times (default 1)\n"
+        "  --width W       Render pages W pixels wide (default 1024, or the\n"
+        "                  window width with --gl)\n"
+        "  --quads N       With --gl, also time drawing N page quads per\n"
+        "                  frame\n",
+        argv0);
+}
+
+/* Parses the command line, returns non-zero on error */
+static int parse_args(int argc, char **argv, char **filename)
+{
+    int i;
+    int cache_mb = 1, disk_cache_mb = 1, fps = 60;
+
+    *filename = NULL;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--bench")) {
+            bench = 1;
+        } else if (!strcmp(argv[i], "--gl")) {
+            bench_gl = 1;
+        } else if (!strcmp(argv[i], "--no-pbo")) {
+            use_pbo = 0;
+        } else if (!strcmp(argv[i], "--no-mipmap")) {
+            use_mipmap = 0;
+        } else if (!strcmp(argv[i], "--no-gray")) {
+            detect_gray = 0;
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            force_thread_count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--preview") && i + 1 < argc) {
+            preview_scale = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--bands") && i + 1 < argc) {
+            band_count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--list-cache") && i + 1 < argc) {
+            list_cache_size = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--log-level") && i + 1 < argc) {
+            log_level = parse_log_level(argv[++i]);
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (!strcmp(argv[i], "--disk-cache") && i + 1 < argc) {
+            disk_cache_dir = argv[++i];
+        } else if (!strcmp(argv[i], "--disk-cache-mb") && i + 1 < argc) {
+            disk_cache_mb = atoi(argv[++i]);
+            disk_cache_limit = (size_t)disk_cache_mb << 20;
+        } else if (!strcmp(argv[i], "--cache-mb") && i + 1 < argc) {
+            cache_mb = atoi(argv[++i]);
+            texture_budget = (size_t)cache_mb << 20;
+        } else if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+            fps = atoi(argv[++i]);
+            frame_interval = 1. / fps;
+        } else if (!strcmp(argv[i], "--passes") && i + 1 < argc) {
+            bench_passes = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--width") && i + 1 < argc) {
+            bench_width = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--quads") && i + 1 < argc) {
+            bench_quads = atoi(argv[++i]);
+        } else if (argv[i][0] == '-' || *filename) {
+            return 1;
+        } else {
+            *filename = argv[i];
+        }
+    }
+
+    return !*filename || bench_passes < 1 || bench_quads < 0 ||
+        force_thread_count < 0 || list_cache_size < 0 || band_count < 1 ||
+        cache_mb < 1 || disk_cache_mb < 1 || fps < 1 || log_level < 0 ||
+        preview_scale < 0 || preview_scale >= 1;
+}
+
+/* Stops all render threads and waits for them to exit */
+static void stop_threads(void)
+{
+    int i;
+
+    SDL_mutexP(queue.lock);
+    for (i = 0; i < thread_count; i++)
+        threads[i].keep_running = 0;
+    SDL_CondBroadcast(queue.cond);
+    SDL_mutexV(queue.lock);
+
+    for (i = 0; i < thread_count; i++)
+        SDL_WaitThread(threads[i].handle, NULL);
+}
+
+/* Times drawing 'count' page quads per frame in immediate mode, as the page
+ * view used to, and through the quad batch. The quads use BENCH_TEXTURES
+ * textures in turn, like a tiled view of that many pages would.
+ */
+#define BENCH_TEXTURES 8
+#define BENCH_FRAMES 100
+
+static void bench_draw(int count)
+{
+    GLuint textures[BENCH_TEXTURES];
+    double t, submit[2], total[2];
+    float x, y, size;
+    int mode, frame, i, columns, calls = 0;
+
+    for (i = 0; i < BENCH_TEXTURES; i++)
+        textures[i] = texture_get(64, 64, GL_RGB);
+
+    glEnable(GL_TEXTURE_2D);
+    glViewport(0, 0, (int)w, (int)gl_h);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0.0f, (int)w, (int)gl_h, 0, -1.0f, 1.0f);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    columns = sqrt(count) + 1;
+    size = w / columns;
+
+    for (mode = 0; mode < 2; mode++) {
+        submit[mode] = total[mode] = 0;
+
+        for (frame = 0; frame < BENCH_FRAMES; frame++) {
+            t = least_time();
+
+            for (i = 0; i < count; i++) {
+                x = (i % columns) * size;
+                y = (i / columns) * size;
+
+                if (mode) {
+                    batch_quad(textures[i % BENCH_TEXTURES],
+                        x, y, x + size, y + size, 0, 0, 1, 1);
+                    continue;
+                }
+
+                glBindTexture(GL_TEXTURE_2D, textures[i % BENCH_TEXTURES]);
+                glBegin(GL_QUADS);
+                glTexCoord2f(0, 0);
+                glVertex3f(x, y, 0.f);
+                glTexCoord2f(1, 0);
+                glVertex3f(x + size, y, 0.f);
+                glTexCoord2f(1, 1);
+                glVertex3f(x + size, y + size, 0.f);
+                glTexCoord2f(0, 1);
+                glVertex3f(x, y + size, 0.f);
+                glEnd();
+            }
+
+            if (mode) {
+                batch_draw();
+                calls = batch_calls;
+            }
+
+            submit[mode] += least_time() - t;
+            glFinish();
+            total[mode] += least_time() - t;
+        }
+    }
+
+    for (i = 0; i < BENCH_TEXTURES; i++)
+        texture_put(textures[i], 64, 64, GL_RGB);
+
+    printf("\n  drawing %d quads per frame (ms), %d frames:\n", count,
+        BENCH_FRAMES);
+    printf("  %-10s %9s %9s %9s\n", "path", "submit", "total", "calls");
+    printf("  %-10s %9.3f %9.3f %9d\n", "immediate",
+        submit[0] / BENCH_FRAMES * 1e3, total[0] / BENCH_FRAMES * 1e3,
+        count);
+    printf("  %-10s %9.3f %9.3f %9d\n", "batched",
+        submit[1] / BENCH_FRAMES * 1e3, total[1] / BENCH_FRAMES * 1e3,
+        calls);
+}
+
+/* Benchmark mode
+ *
+ * Renders every page of the document 'bench_passes' times through the
+ * regular render threads and reports throughput and per-stage latency.
+ * No window is opened unless texture uploads are timed as well (--gl).
+ */
+static int run_bench(fz_context *context, char *filename)
+{
+    struct least_samples load, list, raster, upload;
+    struct least_job *job;
+    fz_context *ctx;
+    int jobs, scheduled, completed;
+    int gray_pages = 0, failed_pages = 0, format;
+    double start, elapsed, t, opened, first_page = 0;
+    double pixmap_bytes = 0;
+    GLuint texture;
+
+    memset(&load, 0, sizeof(load));
+    memset(&list, 0, sizeof(list));
+    memset(&raster, 0, sizeof(raster));
+    memset(&upload, 0, sizeof(upload));
+
+    if (bench_gl) {
+        setup_sdl();
+        setup_opengl(w, h);
+        detect_npot();
+        detect_mipmap();
+        init_texture_pool();
+        init_batch();
+    }
+
+    lw = lh = bench_width ? bench_width : (bench_gl ? w : 1024);
+
+    /* Keep at most two jobs per thread outstanding, so completed pixmaps
+     * do not pile up when the main thread is slower than the renderers.
+     */
+    bench_cond = SDL_CreateCond();
+    bench_done = malloc(sizeof(struct least_job*) * thread_count * 2);
+    if (!bench_cond || !bench_done) {
+        fprintf(stderr, "Benchmark initialisation failed\n");
+        abort();
+    }
+    bench_done_count = 0;
+
+    init_threads(thread_count, context);
+
+    /* Open the document on a render thread, as the viewer does. Time to
+     * first page runs from here until page 0 is rendered (and uploaded).
+     */
+    open_pdf(filename);
+
+    SDL_mutexP(queue.lock);
+    while (!bench_done_count)
+        SDL_CondWait(bench_cond, queue.lock);
+    job = bench_done[--bench_done_count];
+    SDL_mutexV(queue.lock);
+
+    opened = least_time() - open_start;
+    if (document_ready(job)) {
+        stop_threads();
+        return 1;
+    }
 
-    /* Place thread into idle pool */
-    idle_threads[idle_thread_count++] = render;
+    jobs = pagec * bench_passes;
+    scheduled = completed = 0;
+    start = least_time();
+
+    SDL_mutexP(queue.lock);
+    while (completed < jobs) {
+        while (scheduled < jobs && scheduled - completed < thread_count * 2) {
+            schedule_page(scheduled % pagec, LEAST_JOB_PAGE, scheduled);
+            scheduled++;
+        }
+        SDL_CondBroadcast(queue.cond);
+
+        while (!bench_done_count)
+            SDL_CondWait(bench_cond, queue.lock);
+        job = bench_done[--bench_done_count];
+        SDL_mutexV(queue.lock);
+
+        if (!job->pixmap) {
+            failed_pages++;
+            pages[job->pagenum].rendering = 0;
+            job_free(job);
+            completed++;
+
+            SDL_mutexP(queue.lock);
+            continue;
+        }
+
+        samples_add(&load, job->times.load);
+        samples_add(&list, job->times.list);
+        samples_add(&raster, job->times.raster);
+
+        ctx = job->thread->context;
+        if (fz_pixmap_components(ctx, job->pixmap) == 1)
+            gray_pages++;
+        pixmap_bytes += (double)fz_pixmap_stride(ctx, job->pixmap) *
+            fz_pixmap_height(ctx, job->pixmap);
+
+        if (bench_gl) {
+            format = pixmap_format(ctx, job->pixmap);
+            t = least_time();
+            texture = pixmap_to_texture(
+                (void*)fz_pixmap_samples(ctx, job->pixmap),
+                fz_pixmap_width(ctx, job->pixmap),
+                fz_pixmap_height(ctx, job->pixmap), format, 0);
+            glFinish();
+            samples_add(&upload, least_time() - t);
+            texture_put(texture, fz_pixmap_width(ctx, job->pixmap),
+                fz_pixmap_height(ctx, job->pixmap), format);
+        }
+
+        if (!job->pagenum && !first_page)
+            first_page = least_time() - open_start;
+
+        fz_drop_pixmap(job->thread->context, job->pixmap);
+
+        pages[job->pagenum].rendering = 0;
+        job_free(job);
+        completed++;
+
+        SDL_mutexP(queue.lock);
+    }
+    SDL_mutexV(queue.lock);
+
+    elapsed = least_time() - start;
+
+    stop_threads();
+
+    /* Print what was logged before the report */
+    log_stop();
+
+    printf("least benchmark: %s\n", filename);
+    printf("  threads: %d, bands: %d, width: %.0f px, pages: %u, "
+        "passes: %d\n", thread_count, band_count, lw, pagec, bench_passes);
+    printf("  rendered %d pages in %.3f s: %.2f pages/s\n",
+        jobs, elapsed, jobs / elapsed);
+    printf("  time to first page: %.1f ms, %.1f ms of it opening\n",
+        first_page * 1e3, opened * 1e3);
+    printf("\n  per-stage latency (ms):\n");
+    printf("  %-8s %9s %9s %9s %9s\n", "stage", "p50", "p90", "p99", "max");
+    print_samples("load", &load);
+    print_samples("list", &list);
+    print_samples("raster", &raster);
+    if (bench_gl)
+        print_samples("upload", &upload);
+
+    printf("\n  display list cache: %d hits, %d misses\n",
+        list_cache_hits, list_cache_misses);
+    printf("  pixmaps: %d of %d gray, %.2f MB per page on average\n",
+        gray_pages, jobs, pixmap_bytes / jobs / (1024 * 1024));
+    if (failed_pages)
+        printf("  %d renders failed\n", failed_pages);
+    if (disk_cache_dir)
+        printf("  disk cache: %d hits, %d misses\n",
+            disk_cache_hits, disk_cache_misses);
+    if (bench_gl)
+        printf("  textures: %d allocated, %d reused from the pool\n",
+            textures_allocated, textures_reused);
+
+    if (bench_gl && bench_quads)
+        bench_draw(bench_quads);
+
+    free(load.v);
+    free(list.v);
+    free(raster.v);
+    free(upload.v);
+
+    return 0;
 }
 
 int main (int argc, char **argv) {
     fz_context *context;
-    int *pageinfo = NULL;
+    char *filename;
+    int ret = 0;
+    double t;
     /* int i; */
 
+    /* Case folding beyond ASCII in text_fold, numbers stay in "C" */
+    setlocale(LC_CTYPE, "");
+
+    if (parse_args(argc, argv, &filename)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Before the log writer, the first thread started */
+    block_stats_signal();
+
+    init_log();
+    init_trace();
+    trace_register("main", -1);
+
     /* Initialises mutexes required for Fitz locking */
     init_least_context_locks();
+    init_list_cache();
 
     context = fz_new_context(NULL, &least_context_locks, FZ_STORE_DEFAULT);
     if (!context)
@@ -1321,7 +6630,13 @@ int main (int argc, char **argv) {
     else
         thread_count = sysconf(_SC_NPROCESSORS_ONLN);
 
-    if (argc == 2) {
+    if (bench) {
+        ret = run_bench(context, filename);
+        log_stop();
+        trace_write();
+    } else {
+        init_stats_signal();
+
         /* Initialize OpenGL window */
         setup_sdl();
 
@@ -1334,22 +6649,22 @@ int main (int argc, char **argv) {
          */
         setup_opengl(w, h);
         init_busy_texture();
-
-        /* Check for non-power-of-two support */
-        /* printf("Extensions are: %s\n", glGetString(GL_EXTENSIONS)); */
-        if (strstr((const char *)glGetString(GL_EXTENSIONS),
-            "GL_ARB_texture_non_power_of_two")) {
-            puts("Machine supports NPOT textures.");
-            power_of_two = 0;
-        } else {
-            puts("Machine supports POT textures only.");
-            power_of_two = 1;
-        }
-
-        power_of_two |= force_power_of_two;
-
-        /* Load textures from PDF file */
-        open_pdf(context, argv[1]);
+        init_texture_pool();
+        init_atlases();
+
+        detect_npot();
+        detect_mipmap();
+        init_pbos();
+        init_batch();
+        init_font();
+
+        /* Open the document on a render thread, the window shows a busy
+         * page meanwhile. Pages follow the window size from now on, see
+         * rescale.
+         */
+        lw = render_width();
+        lh = h;
+        open_pdf(filename);
 
         /*
          * Now we want to begin our normal app process--
@@ -1361,22 +6676,29 @@ int main (int argc, char **argv) {
             process_events();
 
             /* Update cache state */
+            t = trace_begin();
             update_cache();
+            trace_end("update cache", t, -1);
 
             if (redraw) {
                 redraw = 0;
+                t = trace_begin();
                 draw_screen();
+                trace_end("draw", t, -1);
+                t = trace_begin();
+                present_frame();
+                trace_end("present", t, -1);
+            } else {
+                /* Nothing on screen changed, there is no frame */
+                frame_work = 0;
             }
-
-            free(pageinfo);
         }
 
 
     }
 
 
-    fz_drop_document(context, doc);
     fz_drop_context(context);
 
-    return 0;
+    return ret;
 }